@@ -0,0 +1,28 @@
+// Stand-in for a bazel-remote style cache: serves GET/PUT /ac/<key> and
+// /cas/<hash> out of a directory on the loopback interface.
+//
+//   c++ -o cache_server cache_server.cc && ./cache_server <dir> [port]
+//
+// Prints the URL to hand to Remote_Cache::open once it is listening.
+#define MAKER_IMPLEMENTATION
+#include "maker.hh"
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <dir> [port]\n", argv[0]);
+        return 1;
+    }
+
+    maker::Cache_Server server;
+    if (!server.listen(argv[1], argc > 2 ? atoi(argv[2]) : 0))
+    {
+        perror("cache_server");
+        return 1;
+    }
+    printf("http://127.0.0.1:%d\n", server.port);
+    fflush(stdout);
+    server.run();
+    return 0;
+}
@@ -5,6 +5,27 @@
 #include <spawn.h>
 #include <ctype.h>
 #include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/file.h>
 
 extern "C" char **environ;
 
@@ -30,10 +51,76 @@ namespace maker
         int memcmp(const void *left, const void *right, size_t count);
     }
 
+    template<typename T>
+    struct List
+    {
+        T *items = nullptr;
+        size_t length = 0;
+        size_t capacity = 0;
+
+        T &push(const T &item);
+        void append(const T *src, size_t n);
+        void remove(size_t idx);
+        void resize();
+        void release();
+    };
+
+    struct Proc_Result
+    {
+        pid_t pid = 0;
+        int exit_code = -1;
+        int signal = 0;
+        double wall_time = 0;
+        double user_time = 0;
+        double sys_time = 0;
+        long max_rss = 0;
+        bool timed_out = false;
+        bool cancelled = false;
+        List<char> out;
+        List<char> err;
+
+        bool ok() const;
+        void release();
+    };
+
     struct Proc
     {
         pid_t pid = 0;
-        void wait() const;
+        int pidfd = -1;
+        int out_fd = -1;
+        int err_fd = -1;
+        bool group = false;
+        uint64_t started = 0;
+        Proc_Result wait() const;
+        void signal(int sig) const;
+    };
+
+    enum Spawn_Flags
+    {
+        SPAWN_CAPTURE = 1 << 0,
+        SPAWN_GROUP   = 1 << 1,
+    };
+
+    struct Env
+    {
+        char **items = nullptr;
+        size_t length = 0;
+        size_t capacity = 0;
+        List<char*> envp;
+        uint64_t base_stamp = 0;
+
+        Env &set(const char *name, const char *value);
+        Env &unset(const char *name);
+        char **materialize();
+        void resize();
+        void release();
+    };
+
+    struct Redirect
+    {
+        int fd = -1;
+        const char *path = nullptr;
+        int flags = 0;
     };
 
     struct Command
@@ -41,9 +128,18 @@ namespace maker
         char **items = nullptr;
         size_t length = 0;
         size_t capacity = 0;
+        Redirect redirects[3];
+        Env *env = nullptr;
+        bool response_file = false;
+        size_t arg_limit = 0;
+        const char *cwd = nullptr;
 
         Command &push(char*);
         Command &push_null();
+        Command &redirect_in(const char *path);
+        Command &redirect_out(const char *path, bool append = false);
+        Command &redirect_err(const char *path, bool append = false);
+        Command &redirect(int target, int fd);
         void resize();
         void reset();
     };
@@ -96,100 +192,4679 @@ namespace maker
         void resize();
     };
 
-    Proc start_process(const Command &cmd);
+    struct Proc_Set
+    {
+        struct Entry
+        {
+            Proc proc;
+            Proc_Result result;
+            bool exited = false;
+            bool timed_out = false;
+            bool cancelled = false;
+            uint64_t deadline = 0;
+        };
+
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        bool use_pidfd = true;
+        double kill_grace = 2.0;
+        List<Entry> procs;
+
+        void add(Proc proc, double timeout = 0);
+        void wake_on(int fd);
+        void cancel(Entry &entry);
+        void cancel_all();
+        bool wait_any(Proc_Result *result = nullptr);
+        void wait_all();
+        void release();
+    };
+
+    struct Pipeline_Result
+    {
+        List<Proc_Result> stages;
+
+        bool ok() const;
+        void release();
+    };
+
+    struct Pipeline_Proc
+    {
+        List<Proc> stages;
+
+        Pipeline_Result wait();
+    };
+
+    struct Pipeline
+    {
+        Command *items = nullptr;
+        size_t length = 0;
+        size_t capacity = 0;
+
+        Pipeline &push(const Command &cmd);
+        void resize();
+        Pipeline_Proc start(bool capture = false) const;
+        Pipeline_Result run(bool capture = false) const;
+    };
+
+    struct Jobserver
+    {
+        int read_fd = -1;
+        int write_fd = -1;
+        int pipe_fds[2] = {-1, -1};
+        char *fifo_path = nullptr;
+        List<char> flags;
+        List<char> makeflags;
+        List<char*> envp;
+        List<char> tokens;
+
+        bool connect();
+        bool serve(size_t jobs, bool fifo = false);
+        char **child_env(char **base);
+        bool active() const;
+        bool try_acquire();
+        void release_token();
+        void close();
+    };
+
+    struct Job_Result
+    {
+        size_t id = 0;
+        Proc_Result proc;
+
+        bool ok() const;
+    };
+
+    struct Job_Pool
+    {
+        struct Slot
+        {
+            size_t id = 0;
+            Proc proc;
+        };
+
+        size_t max_jobs = 0;
+        size_t submitted = 0;
+        bool capture_output = false;
+        bool echo_output = true;
+        bool use_jobserver = true;
+        bool jobserver_fifo = false;
+        bool jobserver_ready = false;
+        bool fail_fast = false;
+        bool cancelled = false;
+        double timeout = 0;
+        Jobserver jobserver;
+        Proc_Set procs;
+        List<Slot> running;
+        List<Job_Result> results;
+
+        Job_Pool() = default;
+        Job_Pool(size_t max_jobs);
+
+        size_t submit(const Command &cmd);
+        bool wait_one(Job_Result *result = nullptr);
+        bool wait_all();
+        void cancel();
+        void cancel(size_t id);
+        void release();
+    };
+
+    struct Unity_Chunk
+    {
+        char *path = nullptr;
+        List<size_t> sources;
+        double cost = 0;
+        bool changed = false;
+    };
+
+    struct Unity_Build
+    {
+        const char *prefix = "unity";
+        size_t chunk_count = 0;
+        double rebalance_factor = 1.5;
+        List<Unity_Chunk> chunks;
+
+        size_t generate(const String_View *sources, const double *costs, size_t count);
+        size_t submit(Job_Pool &pool, const Command &base);
+        void release();
+    };
+
+    template<typename T>
+    struct String_Map
+    {
+        struct Slot
+        {
+            String_View key;
+            uint64_t hash = 0;
+            T value;
+            bool used = false;
+        };
+
+        Slot *slots = nullptr;
+        size_t count = 0;
+        size_t capacity = 0;
+
+        T *find(String_View key) const;
+        T &insert(String_View key, const T &value);
+        void resize();
+        void release();
+    };
+
+    struct Arena
+    {
+        List<char *> blocks;
+        size_t used = 0;
+        size_t block_size = 64 * 1024;
+
+        char *alloc(size_t n);
+        String_View strdup(String_View sv);
+        void release();
+    };
+
+    struct File_Stat
+    {
+        bool exists = false;
+        uint64_t mtime = 0;
+        uint64_t size = 0;
+        bool hashed = false;
+        uint64_t hash = 0;
+    };
+
+    struct Stat_Cache
+    {
+        String_Map<File_Stat> entries;
+        Arena paths;
+        size_t threads = 0;
+        size_t stat_calls = 0;
+
+        File_Stat get(String_View path);
+        File_Stat refresh(String_View path);
+        uint64_t hash(String_View path);
+        void prefetch(const String_View *paths, size_t count);
+        bool needs_rebuild(const char *const *outputs, size_t n_out, const char *const *inputs, size_t n_in);
+        void release();
+    };
+
+    struct Depfile
+    {
+        List<String_View> targets;
+        List<String_View> deps;
+        Arena unescaped;
+
+        bool parse(String_View text);
+        void release();
+    };
+
+    struct Deps_Record
+    {
+        uint64_t mtime = 0;
+        size_t first = 0;
+        size_t count = 0;
+        bool valid = false;
+    };
+
+    struct Deps_Log
+    {
+        int fd = -1;
+        Arena strings;
+        List<String_View> paths;
+        String_Map<uint32_t> ids;
+        List<Deps_Record> records;
+        List<uint32_t> dep_ids;
+
+        bool open(const char *path);
+        uint32_t intern(String_View path);
+        bool record(String_View output, uint64_t mtime, const String_View *deps, size_t count);
+        bool ingest(const char *depfile, String_View output);
+        const Deps_Record *lookup(String_View output) const;
+        void close();
+    };
+
+    struct Build_Entry
+    {
+        uint64_t cmd_hash = 0;
+        uint64_t content_hash = 0;
+        uint64_t mtime = 0;
+        uint64_t input_mtime = 0;
+        uint64_t duration = 0;
+    };
+
+    struct Build_DB
+    {
+        int fd = -1;
+        char *path = nullptr;
+        const char *map = nullptr;
+        size_t map_size = 0;
+        Arena strings;
+        String_Map<Build_Entry> entries;
+        size_t records = 0;
+        size_t compact_min = 1024;
+
+        bool open(const char *path);
+        const Build_Entry *lookup(String_View path) const;
+        bool record(String_View path, const Build_Entry &entry);
+        bool compact();
+        void close();
+    };
+
+    struct Remote_Cache
+    {
+        char *host = nullptr;
+        char *port = nullptr;
+        char *prefix = nullptr;
+        int fd = -1;
+        double timeout = 10;
+        List<char> inbox;
+
+        bool open(const char *url);
+        bool get_many(const char *kind, const uint64_t *names, size_t count, List<char> *bodies, bool *found);
+        bool put_many(const char *kind, const uint64_t *names, const List<char> *bodies, size_t count);
+        void close();
+    };
+
+    struct Cache_Server
+    {
+        char *dir = nullptr;
+        int listen_fd = -1;
+        int port = 0;
+
+        bool listen(const char *dir, int port = 0);
+        void run();
+        void stop();
+    };
+
+    struct Action_Cache
+    {
+        char *dir = nullptr;
+        Remote_Cache *remote = nullptr;
+        uint64_t max_size = 1ull << 30;
+        uint64_t added = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+
+        bool open(const char *dir);
+        bool lookup(uint64_t key, const char *const *outputs, size_t count, Proc_Result &replay);
+        bool store(uint64_t key, const char *const *outputs, size_t count, const Proc_Result &result);
+        uint64_t direct_key(uint64_t key, Stat_Cache &stats);
+        uint64_t record_manifest(uint64_t key, const String_View *headers, size_t count, Stat_Cache &stats);
+        void pull_actions(const uint64_t *keys, size_t count, bool *found);
+        void pull_manifests(const uint64_t *keys, size_t count, bool *found);
+        void push_action(uint64_t key);
+        void push_manifest(uint64_t key);
+        int lock(uint64_t key, bool wait);
+        void unlock(uint64_t key, int fd);
+        void evict();
+        void close();
+    };
+
+    enum Remote_Kind
+    {
+        REMOTE_GET_ACTION,
+        REMOTE_GET_MANIFEST,
+        REMOTE_PUT_ACTION,
+        REMOTE_PUT_MANIFEST,
+        REMOTE_LOCK,
+    };
+
+    struct Remote_Job
+    {
+        Remote_Kind kind = REMOTE_GET_ACTION;
+        size_t rule = 0;
+        uint64_t key = 0;
+        bool found = false;
+        int fd = -1;
+    };
+
+    struct Remote_Queue
+    {
+        Action_Cache *cache = nullptr;
+        pthread_t thread;
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+        pthread_cond_t lock_cond = PTHREAD_COND_INITIALIZER;
+        List<Remote_Job> pending;
+        List<Remote_Job> done;
+        List<Remote_Job> lock_pending;
+        pthread_t lock_thread;
+        bool lock_started = false;
+        int wake_fd = -1;
+        bool started = false;
+        bool stopping = false;
+
+        bool start(Action_Cache *cache);
+        void push(const Remote_Job &job);
+        size_t cancel(size_t rule);
+        void wait_lock(size_t rule, uint64_t key);
+        bool pop(Remote_Job &job);
+        void wait();
+        void stop();
+    };
+
+    enum Rule_State
+    {
+        RULE_WAITING,
+        RULE_FETCHING,
+        RULE_BLOCKED,
+        RULE_RUNNING,
+        RULE_DONE,
+        RULE_FAILED,
+    };
+
+    struct Rule
+    {
+        Command cmd;
+        const char *depfile = nullptr;
+        uint64_t key = 0;
+        bool cache_checked = false;
+        bool racing = false;
+        uint64_t won_key = 0;
+        size_t job = 0;
+        size_t leader = 0;
+        int lock_fd = -1;
+        List<const char *> inputs;
+        List<const char *> outputs;
+        List<size_t> dependents;
+        size_t pending = 0;
+        bool needed = false;
+        bool ran = false;
+        Rule_State state = RULE_WAITING;
+
+        Rule &input(const char *path);
+        Rule &output(const char *path);
+    };
+
+    struct Graph
+    {
+        List<Rule> rules;
+        String_Map<size_t> producers;
+        Stat_Cache stats;
+        Deps_Log *deps = nullptr;
+        Build_DB *db = nullptr;
+        Action_Cache *cache = nullptr;
+        List<const char *> ignored_flags;
+        bool early_cutoff = true;
+        double race_below = 0;
+        bool keep_going = false;
+
+        Rule &rule(const Command &cmd);
+        bool build(Job_Pool &pool, const char *target = nullptr);
+        void release();
+    };
+
+    bool compile_batched(Job_Pool &pool, const Command &base, const String_View *sources, size_t count, const char *out_dir, size_t group_size = 0);
+    size_t submit_batched(Job_Pool &pool, const Command &base, const String_View *files, size_t count, size_t max_per_batch = 0);
+    File_Stat stat_file(const char *path);
+    uint64_t hash_bytes(const void *data, size_t len, uint64_t seed = 0);
+    bool read_entire_file(const char *path, List<char> &out);
+    bool write_entire_file(const char *path, const void *data, size_t len);
+    const char *resolve_program(const char *name);
+    void invalidate_path_cache();
+    uint64_t now_ns();
+    size_t cpu_count();
+    Proc start_process(const Command &cmd, int flags = 0, char **envp = nullptr);
 } // maker
 
-#ifdef MAKER_IMPLEMENTATION
+// List lives on the heap rather than in tmp_buffer: it backs long lived
+// engine state (running jobs, results) that outgrows the scratch buffer.
+template<typename T>
+void maker::List<T>::resize()
+{
+    size_t new_capacity = capacity == 0 ? 4 : capacity * 2;
+    T *new_items = (T *)realloc(items, new_capacity * sizeof(T));
+    ASSERT(new_items != nullptr, "out of memory");
+    items = new_items;
+    capacity = new_capacity;
+}
 
-maker::Proc maker::start_process(const Command &cmd)
+template<typename T>
+T &maker::List<T>::push(const T &item)
 {
-    using namespace maker;
+    if (length >= capacity) resize();
+    items[length] = item;
+    return items[length++];
+}
 
-    Proc proc;
+template<typename T>
+void maker::List<T>::append(const T *src, size_t n)
+{
+    while (length + n > capacity) resize();
+    for (size_t idx = 0; idx < n; ++idx)
+        items[length++] = src[idx];
+}
 
-    ASSERT(
-        posix_spawnp(&proc.pid, cmd.items[0], nullptr, nullptr, cmd.items, environ) == 0,
-        "spawnp_failed"
-    );
+template<typename T>
+void maker::List<T>::remove(size_t idx)
+{
+    if (idx >= length) return;
+    items[idx] = items[--length];
+}
 
-    return proc;
+template<typename T>
+void maker::List<T>::release()
+{
+    free(items);
+    items = nullptr;
+    length = 0;
+    capacity = 0;
 }
 
-void maker::Proc::wait() const
+// Open addressing with linear probing. Keys are views and are not copied:
+// whatever they point at has to outlive the map.
+template<typename T>
+T *maker::String_Map<T>::find(String_View key) const
 {
-    if (pid == 0) return;
-    int status;
-    waitpid(pid, &status, 0);
+    if (capacity == 0) return nullptr;
+    uint64_t hash = hash_bytes(key.data, key.len);
+    for (size_t idx = hash & (capacity - 1);; idx = (idx + 1) & (capacity - 1))
+    {
+        Slot &slot = slots[idx];
+        if (!slot.used) return nullptr;
+        if (slot.hash == hash && slot.key == key) return &slot.value;
+    }
 }
 
-thread_local char maker::Temp_Buffer::buffer[];
-thread_local maker::Temp_Buffer maker::tmp_buffer;
+template<typename T>
+T &maker::String_Map<T>::insert(String_View key, const T &value)
+{
+    if ((count + 1) * 4 > capacity * 3) resize();
+    uint64_t hash = hash_bytes(key.data, key.len);
+    for (size_t idx = hash & (capacity - 1);; idx = (idx + 1) & (capacity - 1))
+    {
+        Slot &slot = slots[idx];
+        if (slot.used && !(slot.hash == hash && slot.key == key)) continue;
+        if (!slot.used) count++;
+        slot.key = key;
+        slot.hash = hash;
+        slot.value = value;
+        slot.used = true;
+        return slot.value;
+    }
+}
 
-constexpr size_t item_size = sizeof(char*);
+template<typename T>
+void maker::String_Map<T>::resize()
+{
+    Slot *old = slots;
+    size_t old_capacity = capacity;
+
+    capacity = capacity == 0 ? 16 : capacity * 2;
+    slots = (Slot *)calloc(capacity, sizeof(Slot));
+    ASSERT(slots != nullptr, "out of memory");
+    count = 0;
+
+    for (size_t idx = 0; idx < old_capacity; ++idx)
+        if (old[idx].used) insert(old[idx].key, old[idx].value);
+    free(old);
+}
 
 template<typename T>
-constexpr inline void swap(T &val1, T &val2)
+void maker::String_Map<T>::release()
 {
-    val1 ^= val2;
-    val2 ^= val1;
-    val1 ^= val2;
+    free(slots);
+    slots = nullptr;
+    count = 0;
+    capacity = 0;
 }
 
-void maker::Temp_Buffer::save()
+#ifdef MAKER_IMPLEMENTATION
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
 {
-    save_point = idx;
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
 }
 
-void maker::Temp_Buffer::load()
+// wyhash-style 64-bit hash: 16 bytes per round, one 128-bit multiply each.
+// Not stable across endianness; only ever compared against itself.
+uint64_t maker::hash_bytes(const void *data, size_t len, uint64_t seed)
 {
-    swap(idx, save_point);
+    const uint64_t k0 = 0xa0761d6478bd642full;
+    const uint64_t k1 = 0xe7037ed1a0b428dbull;
+    const uint64_t k2 = 0x8ebc6af09c88c6e3ull;
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = hash_mix(seed ^ k0, k1 ^ (uint64_t)len);
+
+    while (len >= 16)
+    {
+        uint64_t a, b;
+        __builtin_memcpy(&a, p, 8);
+        __builtin_memcpy(&b, p + 8, 8);
+        h = hash_mix(a ^ k1, b ^ h);
+        p += 16;
+        len -= 16;
+    }
+
+    uint64_t a = 0, b = 0;
+    __builtin_memcpy(&a, p, len < 8 ? len : 8);
+    if (len > 8) __builtin_memcpy(&b, p + 8, len - 8);
+    return hash_mix(k2 ^ h, hash_mix(a ^ k1, b ^ h));
 }
 
-char *maker::Temp_Buffer::alloc(size_t n)
+bool maker::read_entire_file(const char *path, List<char> &out)
 {
-    ASSERT(idx + n <= start_size, "increase static storage size LOL");
-    size_t start_pos = idx;
-    idx += n;
-    return &buffer[start_pos];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    char chunk[16 * 1024];
+    for (;;)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            close(fd);
+            return n == 0;
+        }
+        out.append(chunk, (size_t)n);
+    }
 }
 
-void *maker::Temp_Buffer::resize_buffer(void *ptr, size_t old_n, size_t new_n)
+// Writes next to the destination and renames over it, so readers (and other
+// maker processes) only ever see a complete file.
+bool maker::write_entire_file(const char *path, const void *data, size_t len)
 {
-    if (!ptr) return nullptr;
-    if (old_n >= new_n) return ptr;
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%d.tmp", path, (int)getpid(), (int)syscall(SYS_gettid));
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
 
-    char *new_buf = alloc(new_n);
-    char *src = (char *)ptr;
+    const char *bytes = (const char *)data;
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, bytes + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
 
-    for (size_t idx = 0; idx < old_n; ++idx)
-        new_buf[idx] = src[idx];
+    if (done != len || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
 
-    return new_buf;
+static size_t spawn_size(char *const *argv, char *const *envp)
+{
+    size_t size = 0;
+    for (char *const *arg = argv; arg && *arg; ++arg) size += maker::temp::strlen(*arg) + 1 + sizeof(char*);
+    for (char *const *var = envp; var && *var; ++var) size += maker::temp::strlen(*var) + 1 + sizeof(char*);
+    return size;
 }
 
-void maker::Command::resize()
+// The response file lives in tmpfs when we have one and is named after its
+// contents, so every identical oversized command shares the same file.
+// The "@path" argument goes into arg, which has to outlive the spawn.
+static void with_response_file(const maker::Command &cmd, char (&arg)[PATH_MAX + 1])
 {
-    if (capacity == 0)
+    using namespace maker;
+
+    List<char> content;
+    for (size_t idx = 1; idx < cmd.length && cmd.items[idx]; ++idx)
     {
-        capacity = 4;
-        items = (char **) tmp_buffer.alloc(4 * sizeof(char*));
-        return;
+        for (const char *c = cmd.items[idx]; *c; ++c)
+        {
+            if (isspace(*c) || *c == '\\' || *c == '\'' || *c == '"') content.push('\\');
+            content.push(*c);
+        }
+        content.push('\n');
     }
 
-    items = (char **)tmp_buffer.resize_buffer(items, capacity * sizeof(char*), capacity * 2 * sizeof(char*));
-    capacity *= 2;
+    const char *dir = "/dev/shm";
+    if (access(dir, W_OK) != 0) dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/maker-%016llx.rsp", dir,
+             (unsigned long long)hash_bytes(content.items, content.length));
+
+    struct stat st;
+    if (stat(path, &st) != 0 || (size_t)st.st_size != content.length)
+        ASSERT(write_entire_file(path, content.items, content.length), "could not write response file");
+    content.release();
+
+    snprintf(arg, sizeof(arg), "@%s", path);
 }
 
-maker::Command &maker::Command::push(char *cmd)
+// envp, when given, is used as is instead of cmd.env or environ.
+maker::Proc maker::start_process(const Command &cmd, int flags, char **envp)
 {
-    if (length >= capacity || capacity == 0) resize();
-    items[length++] = cmd;
-    return *this;
+    using namespace maker;
+
+    Proc proc;
+    proc.started = now_ns();
+    bool capture = flags & SPAWN_CAPTURE;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // A child in its own process group can be killed together with
+    // everything it spawned (compiler drivers, test runners, linkers).
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    if (flags & SPAWN_GROUP)
+    {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+        proc.group = true;
+    }
+
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
+    if (capture)
+    {
+        ASSERT(pipe2(out_pipe, O_CLOEXEC) == 0 && pipe2(err_pipe, O_CLOEXEC) == 0, "pipe failed");
+        posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+    }
+
+    for (int target = 0; target < 3; ++target)
+    {
+        const Redirect &r = cmd.redirects[target];
+        if (r.path)
+            posix_spawn_file_actions_addopen(&actions, target, r.path, r.flags, 0644);
+        else if (r.fd >= 0)
+            posix_spawn_file_actions_adddup2(&actions, r.fd, target);
+    }
+
+    if (cmd.cwd) posix_spawn_file_actions_addchdir_np(&actions, cmd.cwd);
+
+    if (!envp) envp = cmd.env ? cmd.env->materialize() : environ;
+    char **argv = cmd.items;
+    char rsp_arg[PATH_MAX + 1];
+    char *rsp_argv[3];
+    if (cmd.response_file)
+    {
+        size_t limit = cmd.arg_limit ? cmd.arg_limit : (size_t)sysconf(_SC_ARG_MAX) - 4096;
+        if (spawn_size(argv, envp) > limit)
+        {
+            with_response_file(cmd, rsp_arg);
+            rsp_argv[0] = cmd.items[0];
+            rsp_argv[1] = rsp_arg;
+            rsp_argv[2] = nullptr;
+            argv = rsp_argv;
+        }
+    }
+
+    const char *path = resolve_program(argv[0]);
+    int err = path
+        ? posix_spawn(&proc.pid, path, &actions, &attr, argv, envp)
+        : posix_spawnp(&proc.pid, argv[0], &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (capture)
+    {
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+        proc.out_fd = out_pipe[0];
+        proc.err_fd = err_pipe[0];
+        fcntl(proc.out_fd, F_SETFL, O_NONBLOCK);
+        fcntl(proc.err_fd, F_SETFL, O_NONBLOCK);
+    }
+
+    ASSERT(err == 0, path ? "spawn_failed" : "spawnp_failed");
+
+    return proc;
 }
 
-maker::Command &maker::Command::push_null()
+struct Path_Entry
 {
-    return push(nullptr);
+    char *name;
+    char *path;
+};
+
+static thread_local maker::List<Path_Entry> path_cache;
+static thread_local char *path_cache_env = nullptr;
+
+static char *heap_strdup(const char *str)
+{
+    char *copy = (char *)malloc(maker::temp::strlen(str) + 1);
+    ASSERT(copy != nullptr, "out of memory");
+    return maker::temp::strcpy(copy, str);
+}
+
+void maker::invalidate_path_cache()
+{
+    for (size_t idx = 0; idx < path_cache.length; ++idx)
+    {
+        free(path_cache.items[idx].name);
+        free(path_cache.items[idx].path);
+    }
+    path_cache.release();
+    free(path_cache_env);
+    path_cache_env = nullptr;
+}
+
+// Resolves a program name against $PATH once and remembers the result, so
+// spawning the same compiler thousands of times does not re-walk PATH with
+// a failed execve per directory. The cache is dropped whenever PATH changes.
+const char *maker::resolve_program(const char *name)
+{
+    if (!name) return nullptr;
+    for (const char *c = name; *c; ++c)
+        if (*c == '/') return name;
+
+    const char *env = getenv("PATH");
+    if (!env) env = "/usr/local/bin:/bin:/usr/bin";
+    if (!path_cache_env || temp::strcmp(path_cache_env, env) != 0)
+    {
+        invalidate_path_cache();
+        path_cache_env = heap_strdup(env);
+    }
+
+    for (size_t idx = 0; idx < path_cache.length; ++idx)
+        if (temp::strcmp(path_cache.items[idx].name, name) == 0)
+            return path_cache.items[idx].path;
+
+    size_t name_len = temp::strlen(name);
+    String_View dirs = env;
+    while (dirs.len > 0)
+    {
+        String_View dir = dirs.chop(':');
+        if (dir.len == 0) dir = ".";
+        if (dir.len + name_len + 2 > PATH_MAX) continue;
+
+        char candidate[PATH_MAX];
+        size_t len = 0;
+        for (size_t idx = 0; idx < dir.len; ++idx) candidate[len++] = dir.data[idx];
+        candidate[len++] = '/';
+        temp::strcpy(candidate + len, name);
+
+        struct stat st;
+        if (stat(candidate, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (access(candidate, X_OK) != 0) continue;
+
+        Path_Entry entry;
+        entry.name = heap_strdup(name);
+        entry.path = heap_strdup(candidate);
+        return path_cache.push(entry).path;
+    }
+
+    return nullptr;
+}
+
+uint64_t maker::now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static double tv_seconds(const timeval &tv)
+{
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+static maker::Proc_Result reap(const maker::Proc &proc, int status, const rusage &usage)
+{
+    maker::Proc_Result result;
+    result.pid = proc.pid;
+    if (WIFEXITED(status)) result.exit_code = WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) result.signal = WTERMSIG(status);
+    result.wall_time = (double)(maker::now_ns() - proc.started) / 1e9;
+    result.user_time = tv_seconds(usage.ru_utime);
+    result.sys_time = tv_seconds(usage.ru_stime);
+    result.max_rss = usage.ru_maxrss;
+    return result;
+}
+
+bool maker::Proc_Result::ok() const
+{
+    return exit_code == 0 && signal == 0;
+}
+
+void maker::Proc_Result::release()
+{
+    out.release();
+    err.release();
+}
+
+void maker::Proc::signal(int sig) const
+{
+    if (pid == 0) return;
+    kill(group ? -pid : pid, sig);
+}
+
+maker::Proc_Result maker::Proc::wait() const
+{
+    if (pid == 0) return {};
+    if (out_fd >= 0 || err_fd >= 0)
+    {
+        Proc_Set set;
+        Proc_Result result;
+        set.add(*this);
+        set.wait_any(&result);
+        set.release();
+        return result;
+    }
+
+    int status = 0;
+    rusage usage = {};
+    while (wait4(pid, &status, 0, &usage) < 0)
+        if (errno != EINTR) return {};
+    return reap(*this, status, usage);
+}
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static bool watch(int epoll_fd, int fd)
+{
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static void unwatch(int epoll_fd, int &fd)
+{
+    if (fd < 0) return;
+    if (epoll_fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    fd = -1;
+}
+
+// Reads whatever the pipe has buffered; false once the writer is gone.
+static bool drain(int fd, maker::List<char> &buf)
+{
+    char chunk[4096];
+    for (;;)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n > 0)
+        {
+            buf.append(chunk, (size_t)n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return n < 0 && errno == EAGAIN;
+    }
+}
+
+static void reap_entry(maker::Proc_Set::Entry &entry, int status, const rusage &usage)
+{
+    maker::Proc_Result result = reap(entry.proc, status, usage);
+    result.out = entry.result.out;
+    result.err = entry.result.err;
+    result.timed_out = entry.timed_out;
+    result.cancelled = entry.cancelled;
+    entry.result = result;
+    entry.exited = true;
+}
+
+static uint64_t seconds_ns(double seconds)
+{
+    return (uint64_t)(seconds * 1e9);
+}
+
+void maker::Proc_Set::add(Proc proc, double timeout)
+{
+    if (epoll_fd < 0)
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) use_pidfd = false;
+    }
+
+    if (use_pidfd && proc.pidfd < 0)
+    {
+        proc.pidfd = (int)syscall(SYS_pidfd_open, proc.pid, 0);
+        if (proc.pidfd < 0) use_pidfd = false;
+    }
+
+    if (use_pidfd)
+        ASSERT(watch(epoll_fd, proc.pidfd), "epoll_ctl failed");
+    if (proc.out_fd >= 0)
+        ASSERT(watch(epoll_fd, proc.out_fd), "epoll_ctl failed");
+    if (proc.err_fd >= 0)
+        ASSERT(watch(epoll_fd, proc.err_fd), "epoll_ctl failed");
+
+    Entry entry;
+    entry.proc = proc;
+    if (timeout > 0) entry.deadline = proc.started + seconds_ns(timeout);
+    procs.push(entry);
+}
+
+// From now on wait_any also returns (false) as soon as fd is readable, so a
+// caller can wait on its children and some other event source at once.
+// Draining fd is up to the caller; -1 switches this off again.
+void maker::Proc_Set::wake_on(int fd)
+{
+    if (epoll_fd < 0)
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) use_pidfd = false;
+    }
+    if (wake_fd >= 0 && epoll_fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, wake_fd, nullptr);
+    wake_fd = fd;
+    if (wake_fd >= 0 && epoll_fd >= 0)
+        ASSERT(watch(epoll_fd, wake_fd), "epoll_ctl failed");
+}
+
+// SIGTERM first; whoever is still around kill_grace later gets SIGKILL.
+void maker::Proc_Set::cancel(Entry &entry)
+{
+    if (entry.exited || entry.cancelled) return;
+    entry.cancelled = true;
+    entry.proc.signal(SIGTERM);
+    entry.deadline = now_ns() + seconds_ns(kill_grace);
+}
+
+void maker::Proc_Set::cancel_all()
+{
+    for (size_t idx = 0; idx < procs.length; ++idx)
+        cancel(procs.items[idx]);
+}
+
+// Fires whatever deadlines passed and returns the epoll timeout (ms) until
+// the next one, or -1 when nothing is pending.
+static int expire_deadlines(maker::Proc_Set &set)
+{
+    uint64_t now = maker::now_ns();
+    uint64_t next = 0;
+
+    for (size_t idx = 0; idx < set.procs.length; ++idx)
+    {
+        maker::Proc_Set::Entry &entry = set.procs.items[idx];
+        if (entry.exited || entry.deadline == 0) continue;
+
+        if (entry.deadline <= now)
+        {
+            if (entry.cancelled)
+            {
+                entry.proc.signal(SIGKILL);
+                entry.deadline = 0;
+                continue;
+            }
+            entry.timed_out = true;
+            set.cancel(entry);
+        }
+        if (next == 0 || entry.deadline < next) next = entry.deadline;
+    }
+
+    if (next == 0) return -1;
+    return (int)((next - now + 999999) / 1000000);
+}
+
+// Child exits and captured output share one epoll loop; a child is handed
+// back only once it has exited and both of its pipes reached EOF.
+//
+// Pidfds let us wait on exactly our own children. Without them we fall back
+// to waitid(P_ALL), which cannot tell whose child exited, so a child that is
+// not in the set gets reaped and dropped.
+bool maker::Proc_Set::wait_any(Proc_Result *result)
+{
+    while (procs.length > 0)
+    {
+        bool pipes_open = false;
+        bool running = false;
+        for (size_t idx = 0; idx < procs.length; ++idx)
+        {
+            Entry &entry = procs.items[idx];
+            if (!entry.exited) running = true;
+            if (entry.proc.out_fd >= 0 || entry.proc.err_fd >= 0)
+            {
+                pipes_open = true;
+                continue;
+            }
+            if (!entry.exited) continue;
+
+            if (result) *result = entry.result;
+            else entry.result.release();
+            procs.remove(idx);
+            return true;
+        }
+
+        int timeout = expire_deadlines(*this);
+        bool poll_children = !use_pidfd && (pipes_open || timeout >= 0 || wake_fd >= 0);
+        if (poll_children && (timeout < 0 || timeout > 10)) timeout = 10;
+
+        if (use_pidfd || poll_children)
+        {
+            epoll_event events[16];
+            int n = epoll_fd >= 0
+                ? epoll_wait(epoll_fd, events, 16, timeout)
+                : poll(nullptr, 0, timeout);
+            if (n < 0 && errno == EINTR) continue;
+            ASSERT(n >= 0, "epoll_wait failed");
+
+            bool woken = false;
+            for (int ev = 0; ev < n; ++ev)
+            {
+                int fd = events[ev].data.fd;
+                if (fd == wake_fd) woken = true;
+                for (size_t idx = 0; idx < procs.length; ++idx)
+                {
+                    Entry &entry = procs.items[idx];
+                    if (fd == entry.proc.out_fd && !drain(fd, entry.result.out))
+                        unwatch(epoll_fd, entry.proc.out_fd);
+                    if (fd == entry.proc.err_fd && !drain(fd, entry.result.err))
+                        unwatch(epoll_fd, entry.proc.err_fd);
+                    if (fd != entry.proc.pidfd) continue;
+
+                    int status = 0;
+                    rusage usage = {};
+                    if (wait4(entry.proc.pid, &status, 0, &usage) < 0) continue;
+                    unwatch(epoll_fd, entry.proc.pidfd);
+                    reap_entry(entry, status, usage);
+                }
+            }
+            if (woken) return false;
+            if (use_pidfd || !running) continue;
+        }
+
+        siginfo_t info = {};
+        int flags = WEXITED | WNOWAIT | (poll_children ? WNOHANG : 0);
+        if (waitid(P_ALL, 0, &info, flags) < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (info.si_pid <= 0) continue;
+
+        int status = 0;
+        rusage usage = {};
+        if (wait4(info.si_pid, &status, 0, &usage) < 0) continue;
+
+        for (size_t idx = 0; idx < procs.length; ++idx)
+        {
+            Entry &entry = procs.items[idx];
+            if (entry.proc.pid != info.si_pid) continue;
+            unwatch(epoll_fd, entry.proc.pidfd);
+            reap_entry(entry, status, usage);
+        }
+    }
+    return false;
+}
+
+void maker::Proc_Set::wait_all()
+{
+    while (wait_any());
+}
+
+void maker::Proc_Set::release()
+{
+    for (size_t idx = 0; idx < procs.length; ++idx)
+    {
+        Entry &entry = procs.items[idx];
+        unwatch(epoll_fd, entry.proc.pidfd);
+        unwatch(epoll_fd, entry.proc.out_fd);
+        unwatch(epoll_fd, entry.proc.err_fd);
+        entry.result.release();
+    }
+    if (epoll_fd >= 0) close(epoll_fd);
+    epoll_fd = -1;
+    wake_fd = -1;
+    procs.release();
+}
+
+bool maker::Pipeline_Result::ok() const
+{
+    if (stages.length == 0) return false;
+    for (size_t idx = 0; idx < stages.length; ++idx)
+        if (!stages.items[idx].ok()) return false;
+    return true;
+}
+
+void maker::Pipeline_Result::release()
+{
+    for (size_t idx = 0; idx < stages.length; ++idx)
+        stages.items[idx].release();
+    stages.release();
+}
+
+maker::Pipeline_Result maker::Pipeline_Proc::wait()
+{
+    Pipeline_Result result;
+    Proc_Set set;
+    for (size_t idx = 0; idx < stages.length; ++idx)
+    {
+        set.add(stages.items[idx]);
+        result.stages.push(Proc_Result{});
+    }
+
+    Proc_Result done;
+    while (set.wait_any(&done))
+        for (size_t idx = 0; idx < stages.length; ++idx)
+            if (stages.items[idx].pid == done.pid) result.stages.items[idx] = done;
+
+    set.release();
+    stages.release();
+    return result;
+}
+
+void maker::Pipeline::resize()
+{
+    if (capacity == 0)
+    {
+        capacity = 4;
+        items = (Command *) tmp_buffer.alloc(4 * sizeof(Command));
+        return;
+    }
+
+    items = (Command *)tmp_buffer.resize_buffer(items, capacity * sizeof(Command), capacity * 2 * sizeof(Command));
+    capacity *= 2;
+}
+
+maker::Pipeline &maker::Pipeline::push(const Command &cmd)
+{
+    if (length >= capacity || capacity == 0) resize();
+    items[length++] = cmd;
+    return *this;
+}
+
+// Every stage is spawned right away with its neighbours joined by pipes, the
+// same way a shell would wire cmd1 | cmd2 | cmd3. With capture the last
+// stage's stdout and stderr are collected like for a single process.
+maker::Pipeline_Proc maker::Pipeline::start(bool capture) const
+{
+    Pipeline_Proc proc;
+    int prev_read = -1;
+
+    for (size_t idx = 0; idx < length; ++idx)
+    {
+        bool last = idx + 1 == length;
+        Command stage = items[idx];
+        int fds[2] = {-1, -1};
+
+        if (prev_read >= 0) stage.redirect(STDIN_FILENO, prev_read);
+        if (!last)
+        {
+            ASSERT(pipe2(fds, O_CLOEXEC) == 0, "pipe failed");
+            stage.redirect(STDOUT_FILENO, fds[1]);
+        }
+
+        proc.stages.push(start_process(stage, capture && last ? SPAWN_CAPTURE : 0));
+
+        if (prev_read >= 0) close(prev_read);
+        if (fds[1] >= 0) close(fds[1]);
+        prev_read = fds[0];
+    }
+
+    return proc;
+}
+
+maker::Pipeline_Result maker::Pipeline::run(bool capture) const
+{
+    return start(capture).wait();
+}
+
+bool maker::Job_Result::ok() const
+{
+    return proc.ok();
+}
+
+size_t maker::cpu_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+// Each job's output goes out in one go once the job is done, so parallel
+// diagnostics never interleave.
+static void write_all(int fd, const maker::List<char> &buf)
+{
+    size_t done = 0;
+    while (done < buf.length)
+    {
+        ssize_t n = write(fd, buf.items + done, buf.length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        done += (size_t)n;
+    }
+}
+
+maker::Job_Pool::Job_Pool(size_t max_jobs)
+    : max_jobs(max_jobs)
+{}
+
+static bool parse_fd(maker::String_View sv, int *fd)
+{
+    if (sv.len == 0) return false;
+    int value = 0;
+    for (size_t idx = 0; idx < sv.len; ++idx)
+    {
+        if (!isdigit(sv.data[idx])) return false;
+        value = value * 10 + (sv.data[idx] - '0');
+    }
+    *fd = value;
+    return true;
+}
+
+// Joins the jobserver advertised by a parent make through MAKEFLAGS, in
+// either the fifo:PATH or the R,W pipe form. Reads need to be non-blocking,
+// so for pipes we reopen the read end through /proc to get our own file
+// description instead of flipping O_NONBLOCK on one shared with make.
+bool maker::Jobserver::connect()
+{
+    const char *flags = getenv("MAKEFLAGS");
+    if (!flags) return false;
+
+    String_View auth;
+    String_View words = flags;
+    while (words.len > 0)
+    {
+        String_View word = words.chop(' ');
+        String_View key = word.chop('=');
+        if (key == "--jobserver-auth" || key == "--jobserver-fds") auth = word;
+    }
+    if (auth.len == 0) return false;
+
+    if (auth.len > 5 && temp::strncmp(auth.data, "fifo:", 5) == 0)
+    {
+        auth.chop_left(5);
+        read_fd = open(auth.cstr(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        write_fd = read_fd;
+        return read_fd >= 0;
+    }
+
+    int r = -1, w = -1;
+    String_View r_sv = auth.chop(',');
+    if (!parse_fd(r_sv, &r) || !parse_fd(auth, &w)) return false;
+    if (fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0) return false;
+
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", r);
+    read_fd = open(proc_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (read_fd < 0) return false;
+    write_fd = w;
+    return true;
+}
+
+// Becomes the jobserver for everything spawned below us, holding one token
+// per extra job. The default is the R,W pipe form every GNU make since 4.2
+// understands (the fds are inheritable on purpose, that is how they reach
+// the children); fifo:PATH needs make 4.4. Children learn about it through
+// MAKEFLAGS in the envp handed to them (see child_env), our own environment
+// is left alone.
+bool maker::Jobserver::serve(size_t jobs, bool fifo)
+{
+    if (jobs < 2) return false;
+
+    char auth[PATH_MAX + 8];
+    if (fifo)
+    {
+        const char *tmp = getenv("TMPDIR");
+        if (!tmp || !*tmp) tmp = "/tmp";
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/maker-jobserver-%d-%p", tmp, (int)getpid(), (void *)this);
+        if (mkfifo(path, 0600) != 0) return false;
+
+        read_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (read_fd < 0)
+        {
+            unlink(path);
+            return false;
+        }
+        write_fd = read_fd;
+        fifo_path = heap_strdup(path);
+        snprintf(auth, sizeof(auth), "fifo:%s", path);
+    }
+    else
+    {
+        if (pipe(pipe_fds) != 0) return false;
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", pipe_fds[0]);
+        read_fd = open(proc_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (read_fd < 0)
+        {
+            ::close(pipe_fds[0]);
+            ::close(pipe_fds[1]);
+            pipe_fds[0] = pipe_fds[1] = -1;
+            return false;
+        }
+        write_fd = pipe_fds[1];
+        snprintf(auth, sizeof(auth), "%d,%d", pipe_fds[0], pipe_fds[1]);
+    }
+
+    for (size_t idx = 0; idx + 1 < jobs; ++idx)
+        release_token();
+
+    char text[PATH_MAX + 64];
+    int len = snprintf(text, sizeof(text), "-j%zu --jobserver-auth=%s", jobs, auth);
+    flags.append(text, (size_t)len);
+    return true;
+}
+
+// The environment for a child of the server: base with our flags added to
+// its MAKEFLAGS. Built for one spawn at a time, into buffers reused by the
+// next.
+char **maker::Jobserver::child_env(char **base)
+{
+    const char *old = nullptr;
+    envp.length = 0;
+    for (char **var = base; var && *var; ++var)
+    {
+        if (temp::strncmp(*var, "MAKEFLAGS=", 10) == 0) old = *var + 10;
+        else envp.push(*var);
+    }
+
+    makeflags.length = 0;
+    makeflags.append("MAKEFLAGS=", 10);
+    if (old && *old)
+    {
+        makeflags.append(old, temp::strlen(old));
+        makeflags.push(' ');
+    }
+    makeflags.append(flags.items, flags.length);
+    makeflags.push('\0');
+    envp.push(makeflags.items);
+    envp.push(nullptr);
+    return envp.items;
+}
+
+bool maker::Jobserver::active() const
+{
+    return read_fd >= 0;
+}
+
+bool maker::Jobserver::try_acquire()
+{
+    char token;
+    for (;;)
+    {
+        ssize_t n = read(read_fd, &token, 1);
+        if (n == 1)
+        {
+            tokens.push(token);
+            return true;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return false;
+    }
+}
+
+void maker::Jobserver::release_token()
+{
+    char token = tokens.length > 0 ? tokens.items[--tokens.length] : '+';
+    while (write(write_fd, &token, 1) < 0 && errno == EINTR);
+}
+
+void maker::Jobserver::close()
+{
+    while (tokens.length > 0) release_token();
+    tokens.release();
+    if (read_fd >= 0) ::close(read_fd);
+    if (pipe_fds[0] >= 0)
+    {
+        ::close(pipe_fds[0]);
+        ::close(pipe_fds[1]);
+    }
+    if (fifo_path)
+    {
+        unlink(fifo_path);
+        free(fifo_path);
+    }
+    flags.release();
+    makeflags.release();
+    envp.release();
+    read_fd = -1;
+    write_fd = -1;
+    pipe_fds[0] = pipe_fds[1] = -1;
+    fifo_path = nullptr;
+}
+
+// Every pool owns one implicit job slot, like make does; each job beyond
+// that runs on a token taken from the jobserver and handed back when a job
+// finishes. When no token is free we wait on our own children instead.
+size_t maker::Job_Pool::submit(const Command &cmd)
+{
+    if (max_jobs == 0) max_jobs = cpu_count();
+    if (use_jobserver && !jobserver_ready)
+    {
+        jobserver_ready = true;
+        if (!jobserver.connect()) jobserver.serve(max_jobs, jobserver_fifo);
+    }
+
+    // A wake-up (Proc_Set::wake_on) is meant for the caller's own wait_one,
+    // not for waiting on a free slot here.
+    int wake_fd = procs.wake_fd;
+    if (wake_fd >= 0) procs.wake_on(-1);
+    while (running.length >= max_jobs)
+        wait_one();
+    if (jobserver.active())
+    {
+        // A token handed back by another process wakes us up as well as
+        // one of our own jobs exiting.
+        procs.wake_on(jobserver.read_fd);
+        while (running.length > 0 && !jobserver.try_acquire())
+            wait_one();
+        procs.wake_on(-1);
+    }
+    if (wake_fd >= 0) procs.wake_on(wake_fd);
+
+    Slot slot;
+    slot.id = submitted++;
+    if (cancelled)
+    {
+        Job_Result res;
+        res.id = slot.id;
+        res.proc.cancelled = true;
+        results.push(res);
+        return slot.id;
+    }
+
+    int flags = 0;
+    if (capture_output) flags |= SPAWN_CAPTURE;
+    if (timeout > 0 || fail_fast) flags |= SPAWN_GROUP;
+    char **envp = nullptr;
+    if (jobserver.flags.length > 0) envp = jobserver.child_env(cmd.env ? cmd.env->materialize() : environ);
+    slot.proc = start_process(cmd, flags, envp);
+    procs.add(slot.proc, timeout);
+    running.push(slot);
+    return slot.id;
+}
+
+bool maker::Job_Pool::wait_one(Job_Result *result)
+{
+    while (running.length > 0)
+    {
+        Proc_Result proc;
+        if (!procs.wait_any(&proc)) return false;
+        pid_t pid = proc.pid;
+
+        for (size_t idx = 0; idx < running.length; ++idx)
+        {
+            if (running.items[idx].proc.pid != pid) continue;
+
+            Job_Result res;
+            res.id = running.items[idx].id;
+            res.proc = proc;
+            running.remove(idx);
+            while (jobserver.tokens.length > 0 && jobserver.tokens.length + 1 > running.length)
+                jobserver.release_token();
+            if (capture_output && echo_output)
+            {
+                write_all(STDOUT_FILENO, proc.out);
+                write_all(STDERR_FILENO, proc.err);
+            }
+            results.push(res);
+            if (fail_fast && !res.ok() && (res.proc.timed_out || !res.proc.cancelled)) cancel();
+            if (result) *result = res;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Once everything has drained a cancelled batch is over: later submits run
+// again.
+bool maker::Job_Pool::wait_all()
+{
+    while (wait_one());
+    cancelled = false;
+
+    for (size_t idx = 0; idx < results.length; ++idx)
+        if (!results.items[idx].ok()) return false;
+    return true;
+}
+
+// Kills every running job (and its process group) and turns later submits
+// into cancelled results without spawning anything, until the next
+// wait_all() (or Graph::build) starts over.
+void maker::Job_Pool::cancel()
+{
+    cancelled = true;
+    procs.cancel_all();
+}
+
+// Cancels a single running job (the pool keeps going); its result still
+// comes back through wait_one, marked cancelled.
+void maker::Job_Pool::cancel(size_t id)
+{
+    for (size_t idx = 0; idx < running.length; ++idx)
+    {
+        if (running.items[idx].id != id) continue;
+        for (size_t entry = 0; entry < procs.procs.length; ++entry)
+            if (procs.procs.items[entry].proc.pid == running.items[idx].proc.pid)
+                procs.cancel(procs.procs.items[entry]);
+    }
+}
+
+static size_t submit_batch(maker::Job_Pool &pool, const maker::Command &base, size_t base_len,
+                         const maker::String_View *files, size_t count)
+{
+    using namespace maker;
+
+    size_t bytes = 0;
+    for (size_t idx = 0; idx < count; ++idx) bytes += files[idx].len + 1;
+
+    List<char> strings;
+    while (strings.capacity < bytes) strings.resize();
+    List<char*> argv;
+    while (argv.capacity < base_len + count + 1) argv.resize();
+
+    for (size_t idx = 0; idx < base_len; ++idx) argv.push(base.items[idx]);
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        argv.push(strings.items + strings.length);
+        strings.append(files[idx].data, files[idx].len);
+        strings.push('\0');
+    }
+    argv.push(nullptr);
+
+    Command cmd = base;
+    cmd.items = argv.items;
+    cmd.length = argv.length;
+    cmd.capacity = argv.capacity;
+    size_t id = pool.submit(cmd);
+
+    argv.release();
+    strings.release();
+    return id;
+}
+
+// xargs for Job_Pool: appends as many files to base as fit under the
+// argument limit (and max_per_batch, when set) and submits each batch as
+// one job. Returns the number of jobs submitted.
+size_t maker::submit_batched(Job_Pool &pool, const Command &base, const String_View *files, size_t count, size_t max_per_batch)
+{
+    size_t base_len = base.length;
+    while (base_len > 0 && base.items[base_len - 1] == nullptr) base_len--;
+
+    size_t limit = base.arg_limit ? base.arg_limit : (size_t)sysconf(_SC_ARG_MAX) - 4096;
+    char **envp = base.env ? base.env->materialize() : environ;
+    size_t fixed = spawn_size(envp, nullptr) + sizeof(char*);
+    for (size_t idx = 0; idx < base_len; ++idx)
+        fixed += temp::strlen(base.items[idx]) + 1 + sizeof(char*);
+
+    size_t batches = 0;
+    size_t first = 0;
+    while (first < count)
+    {
+        size_t size = fixed;
+        size_t last = first;
+        while (last < count)
+        {
+            size_t cost = files[last].len + 1 + sizeof(char*);
+            if (last > first && size + cost > limit) break;
+            if (max_per_batch && last - first >= max_per_batch) break;
+            size += cost;
+            last++;
+        }
+
+        submit_batch(pool, base, base_len, files + first, last - first);
+        batches++;
+        first = last;
+    }
+    return batches;
+}
+
+static maker::String_View path_basename(maker::String_View path)
+{
+    size_t idx = path.len;
+    while (idx > 0 && path.data[idx - 1] != '/') idx--;
+    path.chop_left(idx);
+    return path;
+}
+
+struct Compile_Group
+{
+    size_t id;
+    size_t first;
+    size_t count;
+};
+
+// Compiles sources with one compiler invocation per group ("cc -c a.c b.c
+// c.c") so driver startup is paid once per group rather than once per file.
+// Objects land in out_dir, which becomes the compiler's working directory:
+// sources are made absolute here, any relative paths in base (-I, ...) have
+// to be absolute already. Two sources with the same basename never share a
+// group since their objects would collide. A failed group is recompiled one
+// file at a time so every error points at its own source.
+bool maker::compile_batched(Job_Pool &pool, const Command &base, const String_View *sources, size_t count, const char *out_dir, size_t group_size)
+{
+    if (pool.max_jobs == 0) pool.max_jobs = cpu_count();
+    if (group_size == 0) group_size = (count + pool.max_jobs - 1) / pool.max_jobs;
+    if (group_size == 0) group_size = 1;
+
+    List<char> strings;
+    List<size_t> offsets;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        char name[PATH_MAX], resolved[PATH_MAX];
+        snprintf(name, sizeof(name), "%.*s", (int)sources[idx].len, sources[idx].data);
+        const char *abs = realpath(name, resolved);
+        offsets.push(strings.length);
+        if (abs) strings.append(abs, temp::strlen(abs));
+        else strings.append(sources[idx].data, sources[idx].len);
+        strings.push('\0');
+    }
+    List<String_View> paths;
+    for (size_t idx = 0; idx < count; ++idx)
+        paths.push(String_View(strings.items + offsets.items[idx]));
+    offsets.release();
+
+    Command compile;
+    for (size_t idx = 0; idx < base.length && base.items[idx]; ++idx)
+        compile.push(base.items[idx]);
+    size_t base_len = compile.length + 1;
+    compile.push((char *)"-c").push_null();
+    compile.redirects[0] = base.redirects[0];
+    compile.redirects[1] = base.redirects[1];
+    compile.redirects[2] = base.redirects[2];
+    compile.env = base.env;
+    compile.cwd = out_dir;
+
+    // Sources with a clashing basename are parked and retried in a later
+    // group, so a group never produces two objects with the same name.
+    List<String_View> ordered;
+    List<Compile_Group> groups;
+    List<String_View> pending;
+    for (size_t idx = 0; idx < count; ++idx) pending.push(paths.items[idx]);
+    while (pending.length > 0)
+    {
+        List<String_View> parked;
+        size_t first = ordered.length;
+        for (size_t idx = 0; idx < pending.length; ++idx)
+        {
+            String_View name = path_basename(pending.items[idx]);
+            bool clash = false;
+            for (size_t seen = first; seen < ordered.length && !clash; ++seen)
+                clash = path_basename(ordered.items[seen]) == name;
+
+            if (clash) parked.push(pending.items[idx]);
+            else ordered.push(pending.items[idx]);
+
+            if (ordered.length - first == group_size || idx + 1 == pending.length)
+            {
+                if (ordered.length > first)
+                    groups.push(Compile_Group{0, first, ordered.length - first});
+                first = ordered.length;
+            }
+        }
+        pending.release();
+        pending = parked;
+    }
+
+    for (size_t idx = 0; idx < groups.length; ++idx)
+        groups.items[idx].id = submit_batch(pool, compile, base_len, ordered.items + groups.items[idx].first, groups.items[idx].count);
+    pool.wait_all();
+
+    bool ok = true;
+    size_t retried_from = pool.results.length;
+    for (size_t idx = 0; idx < groups.length; ++idx)
+    {
+        Compile_Group &group = groups.items[idx];
+        bool group_ok = false;
+        for (size_t res = 0; res < pool.results.length; ++res)
+            if (pool.results.items[res].id == group.id) group_ok = pool.results.items[res].ok();
+        if (group_ok || group.count == 1)
+        {
+            ok = ok && group_ok;
+            continue;
+        }
+
+        for (size_t file = 0; file < group.count; ++file)
+            submit_batch(pool, compile, base_len, ordered.items + group.first + file, 1);
+    }
+
+    pool.wait_all();
+    for (size_t res = retried_from; res < pool.results.length; ++res)
+        ok = ok && pool.results.items[res].ok();
+
+    groups.release();
+    ordered.release();
+    paths.release();
+    strings.release();
+    return ok;
+}
+
+struct Unity_Cost
+{
+    double cost;
+    size_t idx;
+};
+
+static int by_cost_desc(const void *left, const void *right)
+{
+    const Unity_Cost *l = (const Unity_Cost *)left;
+    const Unity_Cost *r = (const Unity_Cost *)right;
+    if (l->cost != r->cost) return l->cost < r->cost ? 1 : -1;
+    return l->idx < r->idx ? -1 : l->idx > r->idx;
+}
+
+static int by_index(const void *left, const void *right)
+{
+    size_t l = *(const size_t *)left;
+    size_t r = *(const size_t *)right;
+    return l < r ? -1 : l > r;
+}
+
+static size_t lightest_chunk(const maker::List<maker::Unity_Chunk> &chunks)
+{
+    size_t best = 0;
+    for (size_t idx = 1; idx < chunks.length; ++idx)
+        if (chunks.items[idx].cost < chunks.items[best].cost) best = idx;
+    return best;
+}
+
+// Writes <prefix>_<n>.cc unity files that #include the sources, balanced by
+// their historical compile cost (costs may be null, every source then costs
+// 1). Sources stay in the chunk the previous unity files put them in, new
+// ones go to the lightest chunk, and a file is only rewritten when its
+// contents change, so adding or removing a source rebuilds a single chunk.
+// Only when the chunks drift more than rebalance_factor past the average
+// are they redistributed from scratch (longest first onto the lightest).
+// Returns the number of unity files that changed.
+size_t maker::Unity_Build::generate(const String_View *sources, const double *costs, size_t count)
+{
+    size_t n = chunk_count ? chunk_count : cpu_count();
+    if (n > count) n = count;
+    if (n == 0) n = 1;
+
+    for (size_t idx = 0; idx < chunks.length; ++idx)
+    {
+        free(chunks.items[idx].path);
+        chunks.items[idx].sources.release();
+    }
+    chunks.length = 0;
+
+    List<char> strings;
+    List<size_t> offsets;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        char name[PATH_MAX], resolved[PATH_MAX];
+        snprintf(name, sizeof(name), "%.*s", (int)sources[idx].len, sources[idx].data);
+        const char *abs = realpath(name, resolved);
+        offsets.push(strings.length);
+        if (abs) strings.append(abs, temp::strlen(abs));
+        else strings.append(sources[idx].data, sources[idx].len);
+        strings.push('\0');
+    }
+
+    List<long> assigned;
+    for (size_t idx = 0; idx < count; ++idx) assigned.push(-1);
+
+    for (size_t c = 0; c < n; ++c)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s_%zu.cc", prefix, c);
+        Unity_Chunk chunk;
+        chunk.path = heap_strdup(path);
+        chunks.push(chunk);
+
+        List<char> old;
+        if (!read_entire_file(path, old)) continue;
+        String_View content;
+        content.data = old.items;
+        content.len = old.length;
+        while (content.len > 0)
+        {
+            String_View line = content.chop('\n');
+            if (line.len < 11 || temp::strncmp(line.data, "#include \"", 10) != 0) continue;
+            line.chop_left(10);
+            line.len--;
+            for (size_t idx = 0; idx < count; ++idx)
+                if (assigned.items[idx] < 0 && line == String_View(strings.items + offsets.items[idx]))
+                    assigned.items[idx] = (long)c;
+        }
+        old.release();
+    }
+
+    double total = 0;
+    List<Unity_Cost> order;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        double cost = costs && costs[idx] > 0 ? costs[idx] : 1.0;
+        total += cost;
+        order.push(Unity_Cost{cost, idx});
+        if (assigned.items[idx] >= 0) chunks.items[assigned.items[idx]].cost += cost;
+    }
+    qsort(order.items, order.length, sizeof(Unity_Cost), by_cost_desc);
+
+    for (size_t idx = 0; idx < order.length; ++idx)
+    {
+        Unity_Cost &item = order.items[idx];
+        if (assigned.items[item.idx] >= 0) continue;
+        size_t c = lightest_chunk(chunks);
+        assigned.items[item.idx] = (long)c;
+        chunks.items[c].cost += item.cost;
+    }
+
+    double heaviest = 0;
+    for (size_t c = 0; c < n; ++c)
+        if (chunks.items[c].cost > heaviest) heaviest = chunks.items[c].cost;
+    if (n > 1 && heaviest > rebalance_factor * total / (double)n)
+    {
+        for (size_t c = 0; c < n; ++c) chunks.items[c].cost = 0;
+        for (size_t idx = 0; idx < order.length; ++idx)
+        {
+            size_t c = lightest_chunk(chunks);
+            assigned.items[order.items[idx].idx] = (long)c;
+            chunks.items[c].cost += order.items[idx].cost;
+        }
+    }
+
+    for (size_t idx = 0; idx < count; ++idx)
+        chunks.items[assigned.items[idx]].sources.push(idx);
+
+    size_t changed = 0;
+    for (size_t c = 0; c < n; ++c)
+    {
+        Unity_Chunk &chunk = chunks.items[c];
+        qsort(chunk.sources.items, chunk.sources.length, sizeof(size_t), by_index);
+
+        List<char> content;
+        const char *header = "// Generated by maker, do not edit.\n";
+        content.append(header, temp::strlen(header));
+        for (size_t idx = 0; idx < chunk.sources.length; ++idx)
+        {
+            const char *path = strings.items + offsets.items[chunk.sources.items[idx]];
+            content.append("#include \"", 10);
+            content.append(path, temp::strlen(path));
+            content.append("\"\n", 2);
+        }
+
+        List<char> old;
+        bool same = read_entire_file(chunk.path, old) && old.length == content.length;
+        for (size_t idx = 0; same && idx < old.length; ++idx)
+            same = old.items[idx] == content.items[idx];
+        old.release();
+
+        if (!same)
+        {
+            ASSERT(write_entire_file(chunk.path, content.items, content.length), "could not write unity file");
+            chunk.changed = true;
+            changed++;
+        }
+        content.release();
+    }
+
+    for (size_t c = n;; ++c)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s_%zu.cc", prefix, c);
+        if (unlink(path) != 0) break;
+    }
+
+    order.release();
+    assigned.release();
+    offsets.release();
+    strings.release();
+    return changed;
+}
+
+// Whether the object of a chunk is at least as new as everything its last
+// depfile lists: the unity file, the sources it includes and their headers.
+static bool unity_fresh(const char *obj, const char *dep)
+{
+    using namespace maker;
+
+    File_Stat out = stat_file(obj);
+    if (!out.exists) return false;
+
+    List<char> text;
+    Depfile parsed;
+    bool fresh = read_entire_file(dep, text);
+    if (fresh)
+    {
+        String_View sv;
+        sv.data = text.items;
+        sv.len = text.length;
+        fresh = parsed.parse(sv) && parsed.deps.length > 0;
+    }
+    for (size_t idx = 0; fresh && idx < parsed.deps.length; ++idx)
+    {
+        char path[PATH_MAX];
+        const String_View &name = parsed.deps.items[idx];
+        snprintf(path, sizeof(path), "%.*s", (int)name.len, name.data);
+        File_Stat st = stat_file(path);
+        fresh = st.exists && st.mtime <= out.mtime;
+    }
+    parsed.release();
+    text.release();
+    return fresh;
+}
+
+// One "<base> -c <prefix>_<n>.cc -o <prefix>_<n>.o -MMD -MF <prefix>_<n>.d"
+// job per chunk that needs it: a chunk whose unity file did not change is
+// left alone while its object is fresh (see unity_fresh). Returns the number
+// of jobs submitted.
+size_t maker::Unity_Build::submit(Job_Pool &pool, const Command &base)
+{
+    size_t base_len = base.length;
+    while (base_len > 0 && base.items[base_len - 1] == nullptr) base_len--;
+
+    List<char*> argv;
+    size_t submitted = 0;
+    for (size_t c = 0; c < chunks.length; ++c)
+    {
+        char *path = chunks.items[c].path;
+        int stem = (int)temp::strlen(path) - 3;
+        char obj[PATH_MAX], dep[PATH_MAX];
+        snprintf(obj, sizeof(obj), "%.*s.o", stem, path);
+        snprintf(dep, sizeof(dep), "%.*s.d", stem, path);
+        if (!chunks.items[c].changed && unity_fresh(obj, dep)) continue;
+
+        argv.length = 0;
+        argv.append(base.items, base_len);
+        argv.push((char *)"-c");
+        argv.push(path);
+        argv.push((char *)"-o");
+        argv.push(obj);
+        argv.push((char *)"-MMD");
+        argv.push((char *)"-MF");
+        argv.push(dep);
+        argv.push(nullptr);
+
+        Command cmd = base;
+        cmd.items = argv.items;
+        cmd.length = argv.length;
+        cmd.capacity = argv.capacity;
+        pool.submit(cmd);
+        submitted++;
+    }
+    argv.release();
+    return submitted;
+}
+
+void maker::Unity_Build::release()
+{
+    for (size_t idx = 0; idx < chunks.length; ++idx)
+    {
+        free(chunks.items[idx].path);
+        chunks.items[idx].sources.release();
+    }
+    chunks.release();
+}
+
+char *maker::Arena::alloc(size_t n)
+{
+    if (n > block_size)
+    {
+        // Oversized allocations get a block of their own, slotted in below
+        // the block we are currently bumping through.
+        char *block = (char *)malloc(n);
+        ASSERT(block != nullptr, "out of memory");
+        blocks.push(block);
+        if (blocks.length > 1)
+        {
+            blocks.items[blocks.length - 1] = blocks.items[blocks.length - 2];
+            blocks.items[blocks.length - 2] = block;
+        }
+        else used = block_size;
+        return block;
+    }
+
+    if (blocks.length == 0 || used + n > block_size)
+    {
+        char *block = (char *)malloc(block_size);
+        ASSERT(block != nullptr, "out of memory");
+        blocks.push(block);
+        used = 0;
+    }
+
+    char *ptr = blocks.items[blocks.length - 1] + used;
+    used += n;
+    return ptr;
+}
+
+maker::String_View maker::Arena::strdup(String_View sv)
+{
+    char *copy = alloc(sv.len + 1);
+    for (size_t idx = 0; idx < sv.len; ++idx) copy[idx] = sv.data[idx];
+    copy[sv.len] = '\0';
+    String_View result;
+    result.data = copy;
+    result.len = sv.len;
+    return result;
+}
+
+void maker::Arena::release()
+{
+    for (size_t idx = 0; idx < blocks.length; ++idx) free(blocks.items[idx]);
+    blocks.release();
+    used = 0;
+}
+
+// statx gives us nanosecond mtimes; plain stat is the fallback for kernels
+// or filesystems without it.
+maker::File_Stat maker::stat_file(const char *path)
+{
+    File_Stat result;
+    struct statx stx;
+    if (statx(AT_FDCWD, path, 0, STATX_MTIME | STATX_SIZE, &stx) == 0)
+    {
+        result.exists = true;
+        result.mtime = (uint64_t)stx.stx_mtime.tv_sec * 1000000000ull + stx.stx_mtime.tv_nsec;
+        result.size = stx.stx_size;
+        return result;
+    }
+    if (errno != ENOSYS) return result;
+
+    struct stat st;
+    if (stat(path, &st) != 0) return result;
+    result.exists = true;
+    result.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+    result.size = (uint64_t)st.st_size;
+    return result;
+}
+
+// Maps all of fd read only; nullptr for an empty file or on failure.
+static const char *map_file(int fd, size_t &size)
+{
+    struct stat st;
+    size = 0;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) return nullptr;
+    void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return nullptr;
+    size = (size_t)st.st_size;
+    return (const char *)map;
+}
+
+static uint64_t hash_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    size_t size;
+    const char *map = map_file(fd, size);
+    close(fd);
+    uint64_t hash = maker::hash_bytes(map ? map : "", size);
+    if (map) munmap((void *)map, size);
+    return hash;
+}
+
+maker::File_Stat maker::Stat_Cache::get(String_View path)
+{
+    File_Stat *cached = entries.find(path);
+    if (cached) return *cached;
+    return refresh(path);
+}
+
+maker::File_Stat maker::Stat_Cache::refresh(String_View path)
+{
+    char buf[PATH_MAX];
+    if (path.len >= sizeof(buf)) return {};
+    File_Stat *cached = entries.find(path);
+    String_View key = cached ? path : paths.strdup(path);
+    for (size_t idx = 0; idx < path.len; ++idx) buf[idx] = path.data[idx];
+    buf[path.len] = '\0';
+
+    File_Stat st = stat_file(buf);
+    stat_calls++;
+    if (cached) *cached = st;
+    else entries.insert(key, st);
+    return st;
+}
+
+// Content hash of path, computed at most once between refreshes; 0 when
+// the file does not exist.
+uint64_t maker::Stat_Cache::hash(String_View path)
+{
+    File_Stat st = get(path);
+    if (st.hashed || !st.exists) return st.hash;
+
+    char buf[PATH_MAX];
+    for (size_t idx = 0; idx < path.len; ++idx) buf[idx] = path.data[idx];
+    buf[path.len] = '\0';
+    File_Stat *cached = entries.find(path);
+    cached->hash = hash_file(buf);
+    cached->hashed = true;
+    return cached->hash;
+}
+
+struct Stat_Job
+{
+    const maker::String_View *paths;
+    maker::File_Stat *results;
+    size_t count;
+    size_t stride;
+    size_t first;
+};
+
+static void *stat_worker(void *arg)
+{
+    Stat_Job *job = (Stat_Job *)arg;
+    char buf[PATH_MAX];
+    for (size_t idx = job->first; idx < job->count; idx += job->stride)
+    {
+        const maker::String_View &path = job->paths[idx];
+        if (path.len >= sizeof(buf)) continue;
+        for (size_t c = 0; c < path.len; ++c) buf[c] = path.data[c];
+        buf[path.len] = '\0';
+        job->results[idx] = maker::stat_file(buf);
+    }
+    return nullptr;
+}
+
+// Stats every path not cached yet on a few threads at once; on a cold
+// cache or a network filesystem that hides most of the per-call latency.
+// Each path goes into entries up front, so one listed many times (a header
+// shared by every translation unit) is only statted once.
+void maker::Stat_Cache::prefetch(const String_View *list, size_t count)
+{
+    List<String_View> missing;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        if (list[idx].len >= PATH_MAX || entries.find(list[idx])) continue;
+        String_View key = paths.strdup(list[idx]);
+        entries.insert(key, File_Stat{});
+        missing.push(key);
+    }
+    if (missing.length == 0) return;
+    stat_calls += missing.length;
+
+    List<File_Stat> results;
+    for (size_t idx = 0; idx < missing.length; ++idx) results.push(File_Stat{});
+
+    size_t n = threads ? threads : cpu_count();
+    if (n > 16) n = 16;
+    if (n > missing.length / 64 + 1) n = missing.length / 64 + 1;
+
+    Stat_Job jobs[16];
+    pthread_t workers[16];
+    bool created[16] = {};
+    for (size_t t = 0; t < n; ++t)
+    {
+        jobs[t] = Stat_Job{missing.items, results.items, missing.length, n, t};
+        if (t > 0) created[t] = pthread_create(&workers[t], nullptr, stat_worker, &jobs[t]) == 0;
+    }
+
+    stat_worker(&jobs[0]);
+    for (size_t t = 1; t < n; ++t)
+    {
+        if (created[t]) pthread_join(workers[t], nullptr);
+        else stat_worker(&jobs[t]);
+    }
+
+    for (size_t idx = 0; idx < missing.length; ++idx)
+        *entries.find(missing.items[idx]) = results.items[idx];
+
+    results.release();
+    missing.release();
+}
+
+// Dirty when there are no outputs (phony), an output or input is missing,
+// or the oldest output is older than the newest input.
+bool maker::Stat_Cache::needs_rebuild(const char *const *outputs, size_t n_out, const char *const *inputs, size_t n_in)
+{
+    if (n_out == 0) return true;
+
+    uint64_t oldest = UINT64_MAX;
+    for (size_t idx = 0; idx < n_out; ++idx)
+    {
+        File_Stat st = get(outputs[idx]);
+        if (!st.exists) return true;
+        if (st.mtime < oldest) oldest = st.mtime;
+    }
+
+    for (size_t idx = 0; idx < n_in; ++idx)
+    {
+        File_Stat st = get(inputs[idx]);
+        if (!st.exists || st.mtime > oldest) return true;
+    }
+    return false;
+}
+
+void maker::Stat_Cache::release()
+{
+    entries.release();
+    paths.release();
+}
+
+// Makefile-style depfile as written by -MD/-MMD. Tokens are views straight
+// into text; only tokens with escapes (\\ , \\#, $$) are copied out into the
+// arena. Backslash-newline continues a rule. Targets come from the first
+// rule only, so the phony "header.h:" rules added by -MP are ignored.
+bool maker::Depfile::parse(String_View text)
+{
+    bool in_deps = false;
+    bool first_rule = true;
+
+    while (text.len > 0)
+    {
+        char c = text.data[0];
+        if (c == '\\' && text.len > 1 && text.data[1] == '\n')
+        {
+            text.chop_left(2);
+            continue;
+        }
+        // Backslash-CRLF continues a rule as well, and so does the bare
+        // backslash-CR a truncated one leaves behind.
+        if (c == '\\' && text.len > 1 && text.data[1] == '\r')
+        {
+            text.chop_left(text.len > 2 && text.data[2] == '\n' ? 3 : 2);
+            continue;
+        }
+        if (c == '\n')
+        {
+            text.chop_left(1);
+            if (in_deps) first_rule = false;
+            in_deps = false;
+            continue;
+        }
+        if (isspace(c))
+        {
+            text.chop_left(1);
+            continue;
+        }
+
+        size_t len = 0;
+        bool escaped = false;
+        while (len < text.len)
+        {
+            char d = text.data[len];
+            char next = len + 1 < text.len ? text.data[len + 1] : '\0';
+            if ((d == '\\' && (next == ' ' || next == '#')) || (d == '$' && next == '$'))
+            {
+                escaped = true;
+                len += 2;
+                continue;
+            }
+            if (isspace(d)) break;
+            if (d == '\\' && (next == '\n' || next == '\r')) break;
+            if (d == ':' && (next == '\0' || isspace(next))) break;
+            len++;
+        }
+
+        // Only a continuation can stop a token before its first byte; step
+        // over it so every round makes progress.
+        if (len == 0 && text.data[0] != ':')
+        {
+            text.chop_left(1);
+            continue;
+        }
+
+        String_View token = text.chop_left(len);
+        if (escaped)
+        {
+            char *copy = unescaped.alloc(token.len);
+            size_t n = 0;
+            for (size_t idx = 0; idx < token.len; ++idx)
+            {
+                char d = token.data[idx];
+                if ((d == '\\' || d == '$') && idx + 1 < token.len) d = token.data[++idx];
+                copy[n++] = d;
+            }
+            token.data = copy;
+            token.len = n;
+        }
+
+        bool colon = text.len > 0 && text.data[0] == ':';
+        if (colon) text.chop_left(1);
+
+        if (!first_rule) continue;
+        if (in_deps)
+        {
+            if (token.len > 0) deps.push(token);
+            continue;
+        }
+        if (token.len > 0) targets.push(token);
+        if (colon) in_deps = true;
+    }
+
+    return targets.length > 0;
+}
+
+void maker::Depfile::release()
+{
+    targets.release();
+    deps.release();
+    unescaped.release();
+}
+
+// The deps log is a header followed by records, each a u32 size/kind word
+// and its payload:
+//   path record: the bytes of the path, zero padded to 4; ids are implicit
+//                (the n-th path record is id n)
+//   deps record: u32 output id, u64 output mtime, u32 dep ids
+// Records only get appended, a newer deps record for an output replaces the
+// older one, and a torn record at the end (crash mid write) is cut off on
+// the next open.
+#define MAKER_DEPS_MAGIC "mkrdeps\0"
+#define MAKER_DEPS_VERSION 1u
+#define MAKER_DEPS_PATH_BIT 0x80000000u
+
+static void deps_put32(maker::List<char> &buf, uint32_t value)
+{
+    buf.append((const char *)&value, 4);
+}
+
+static uint32_t deps_get32(const char *data)
+{
+    uint32_t value;
+    __builtin_memcpy(&value, data, 4);
+    return value;
+}
+
+static bool deps_write(int fd, const maker::List<char> &buf)
+{
+    size_t done = 0;
+    while (done < buf.length)
+    {
+        ssize_t n = write(fd, buf.items + done, buf.length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static void deps_add_path(maker::Deps_Log &log, maker::String_View path)
+{
+    maker::String_View copy = log.strings.strdup(path);
+    uint32_t id = (uint32_t)log.paths.length;
+    log.paths.push(copy);
+    log.ids.insert(copy, id);
+    log.records.push(maker::Deps_Record{});
+}
+
+bool maker::Deps_Log::open(const char *path)
+{
+    fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    size_t length;
+    const char *data = map_file(fd, length);
+    size_t header = 12;
+    size_t valid = 0;
+
+    if (data && length >= header
+        && temp::strncmp(data, MAKER_DEPS_MAGIC, 8) == 0
+        && deps_get32(data + 8) == MAKER_DEPS_VERSION)
+    {
+        valid = header;
+        while (valid + 4 <= length)
+        {
+            uint32_t word = deps_get32(data + valid);
+            size_t size = word & ~MAKER_DEPS_PATH_BIT;
+            if (valid + 4 + size > length) break;
+            const char *payload = data + valid + 4;
+
+            if (word & MAKER_DEPS_PATH_BIT)
+            {
+                String_View sv;
+                sv.data = payload;
+                sv.len = size;
+                while (sv.len > 0 && sv.data[sv.len - 1] == '\0') sv.len--;
+                deps_add_path(*this, sv);
+            }
+            else
+            {
+                if (size < 12 || (size - 12) % 4 != 0) break;
+                uint32_t out = deps_get32(payload);
+                if (out >= records.length) break;
+                Deps_Record rec;
+                __builtin_memcpy(&rec.mtime, payload + 4, 8);
+                rec.first = dep_ids.length;
+                rec.count = (size - 12) / 4;
+                rec.valid = true;
+                for (size_t idx = 0; idx < rec.count; ++idx)
+                    dep_ids.push(deps_get32(payload + 12 + idx * 4));
+                records.items[out] = rec;
+            }
+            valid += 4 + size;
+        }
+    }
+    if (data) munmap((void *)data, length);
+
+    if (valid == 0)
+    {
+        List<char> head;
+        head.append(MAKER_DEPS_MAGIC, 8);
+        deps_put32(head, MAKER_DEPS_VERSION);
+        bool ok = ftruncate(fd, 0) == 0 && deps_write(fd, head);
+        head.release();
+        if (!ok) return false;
+        valid = header;
+    }
+    if (ftruncate(fd, (off_t)valid) != 0) return false;
+    return lseek(fd, 0, SEEK_END) >= 0;
+}
+
+uint32_t maker::Deps_Log::intern(String_View path)
+{
+    uint32_t *id = ids.find(path);
+    if (id) return *id;
+
+    List<char> buf;
+    size_t padded = (path.len + 3) & ~(size_t)3;
+    deps_put32(buf, (uint32_t)padded | MAKER_DEPS_PATH_BIT);
+    buf.append(path.data, path.len);
+    while (buf.length < 4 + padded) buf.push('\0');
+    bool ok = fd < 0 || deps_write(fd, buf);
+    buf.release();
+    ASSERT(ok, "could not write deps log");
+
+    deps_add_path(*this, path);
+    return (uint32_t)paths.length - 1;
+}
+
+bool maker::Deps_Log::record(String_View output, uint64_t mtime, const String_View *deps, size_t count)
+{
+    uint32_t out = intern(output);
+    List<uint32_t> ids_now;
+    for (size_t idx = 0; idx < count; ++idx) ids_now.push(intern(deps[idx]));
+
+    Deps_Record &old = records.items[out];
+    bool same = old.valid && old.mtime == mtime && old.count == count;
+    for (size_t idx = 0; same && idx < count; ++idx)
+        same = dep_ids.items[old.first + idx] == ids_now.items[idx];
+    if (same)
+    {
+        ids_now.release();
+        return true;
+    }
+
+    List<char> buf;
+    deps_put32(buf, (uint32_t)(12 + 4 * count));
+    deps_put32(buf, out);
+    buf.append((const char *)&mtime, 8);
+    for (size_t idx = 0; idx < count; ++idx) deps_put32(buf, ids_now.items[idx]);
+    bool ok = fd < 0 || deps_write(fd, buf);
+    buf.release();
+
+    Deps_Record rec;
+    rec.mtime = mtime;
+    rec.first = dep_ids.length;
+    rec.count = count;
+    rec.valid = true;
+    for (size_t idx = 0; idx < count; ++idx) dep_ids.push(ids_now.items[idx]);
+    records.items[out] = rec;
+    ids_now.release();
+    return ok;
+}
+
+// Folds a compiler depfile into the log under output and deletes it, so
+// the next run never has to parse text again.
+bool maker::Deps_Log::ingest(const char *depfile, String_View output)
+{
+    List<char> text;
+    if (!read_entire_file(depfile, text)) return false;
+
+    String_View sv;
+    sv.data = text.items;
+    sv.len = text.length;
+    Depfile parsed;
+    bool ok = parsed.parse(sv);
+    if (ok)
+    {
+        char out[PATH_MAX];
+        snprintf(out, sizeof(out), "%.*s", (int)output.len, output.data);
+        ok = record(output, stat_file(out).mtime, parsed.deps.items, parsed.deps.length);
+        if (ok) unlink(depfile);
+    }
+
+    parsed.release();
+    text.release();
+    return ok;
+}
+
+const maker::Deps_Record *maker::Deps_Log::lookup(String_View output) const
+{
+    uint32_t *id = ids.find(output);
+    if (!id || !records.items[*id].valid) return nullptr;
+    return &records.items[*id];
+}
+
+void maker::Deps_Log::close()
+{
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    strings.release();
+    paths.release();
+    ids.release();
+    records.release();
+    dep_ids.release();
+}
+
+// The build database is a 16 byte header (magic, u32 version, u32 zero)
+// followed by 8 byte aligned records:
+//   u32 record size, u32 path length, Build_Entry, path zero padded to 8
+// It is mapped rather than read, and the mapping stays around for the
+// lifetime of the database: the keys of entries point straight into it, so
+// opening costs one walk over the record headers and no copying of paths.
+// Records only get appended; the last one for a path wins. Once there are
+// compact_min records and fewer than a third of them are live, open()
+// rewrites the file with one record per path.
+#define MAKER_DB_MAGIC "mkrbuild"
+#define MAKER_DB_VERSION 2u
+#define MAKER_DB_HEADER 16u
+#define MAKER_DB_RECORD (8u + (uint32_t)sizeof(maker::Build_Entry))
+
+static void db_put_record(maker::List<char> &buf, maker::String_View path, const maker::Build_Entry &entry)
+{
+    size_t padded = (path.len + 7) & ~(size_t)7;
+    deps_put32(buf, (uint32_t)(MAKER_DB_RECORD + padded));
+    deps_put32(buf, (uint32_t)path.len);
+    buf.append((const char *)&entry, sizeof(entry));
+    buf.append(path.data, path.len);
+    for (size_t idx = path.len; idx < padded; ++idx) buf.push('\0');
+}
+
+static void db_put_header(maker::List<char> &buf)
+{
+    buf.append(MAKER_DB_MAGIC, 8);
+    deps_put32(buf, MAKER_DB_VERSION);
+    deps_put32(buf, 0);
+}
+
+bool maker::Build_DB::open(const char *db_path)
+{
+    fd = ::open(db_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    path = heap_strdup(db_path);
+    map = map_file(fd, map_size);
+
+    size_t valid = 0;
+    if (map && map_size >= MAKER_DB_HEADER
+        && temp::strncmp(map, MAKER_DB_MAGIC, 8) == 0
+        && deps_get32(map + 8) == MAKER_DB_VERSION)
+    {
+        valid = MAKER_DB_HEADER;
+        while (valid + MAKER_DB_RECORD <= map_size)
+        {
+            uint32_t size = deps_get32(map + valid);
+            uint32_t len = deps_get32(map + valid + 4);
+            if (size % 8 != 0 || size < MAKER_DB_RECORD || valid + size > map_size
+                || len > size - MAKER_DB_RECORD) break;
+
+            String_View key;
+            key.data = map + valid + MAKER_DB_RECORD;
+            key.len = len;
+            Build_Entry entry;
+            __builtin_memcpy(&entry, map + valid + 8, sizeof(entry));
+            entries.insert(key, entry);
+            records++;
+            valid += size;
+        }
+    }
+
+    if (valid == 0)
+    {
+        List<char> head;
+        db_put_header(head);
+        bool ok = ftruncate(fd, 0) == 0 && deps_write(fd, head);
+        head.release();
+        if (!ok) return false;
+        valid = MAKER_DB_HEADER;
+    }
+    if (ftruncate(fd, (off_t)valid) != 0) return false;
+    if (lseek(fd, 0, SEEK_END) < 0) return false;
+
+    if (records >= compact_min && records > 3 * entries.count) return compact();
+    return true;
+}
+
+const maker::Build_Entry *maker::Build_DB::lookup(String_View key) const
+{
+    return entries.find(key);
+}
+
+bool maker::Build_DB::record(String_View key, const Build_Entry &entry)
+{
+    Build_Entry *old = entries.find(key);
+    if (old && __builtin_memcmp(old, &entry, sizeof(entry)) == 0) return true;
+
+    List<char> buf;
+    db_put_record(buf, key, entry);
+    bool ok = fd < 0 || deps_write(fd, buf);
+    buf.release();
+
+    if (old) *old = entry;
+    else entries.insert(strings.strdup(key), entry);
+    records++;
+    return ok;
+}
+
+// Rewrites the database with the live entries only. The old mapping stays
+// valid after the rename, so the keys pointing into it do too.
+bool maker::Build_DB::compact()
+{
+    List<char> buf;
+    db_put_header(buf);
+    for (size_t idx = 0; idx < entries.capacity; ++idx)
+        if (entries.slots[idx].used)
+            db_put_record(buf, entries.slots[idx].key, entries.slots[idx].value);
+    bool ok = write_entire_file(path, buf.items, buf.length);
+    buf.release();
+    if (!ok) return false;
+
+    if (fd >= 0) ::close(fd);
+    fd = ::open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    records = entries.count;
+    return fd >= 0;
+}
+
+void maker::Build_DB::close()
+{
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    if (map) munmap((void *)map, map_size);
+    map = nullptr;
+    map_size = 0;
+    free(path);
+    path = nullptr;
+    strings.release();
+    entries.release();
+    records = 0;
+}
+
+// The action cache is a directory shared by any number of maker processes:
+//   ac/<key>   what a successful run of a command produced: per output its
+//              content hash, size and mode, then the captured stdout/stderr
+//   cas/<hash> output contents, named by hash_bytes of the bytes
+//   mf/<key>   direct mode manifest: the headers a command read on its last
+//              few runs, each with content hash, mtime and size
+//   lock/<key> flock()ed by the process running that action right now
+// Everything is written to a temporary file and renamed into place, blobs
+// before the entry naming them, so readers only ever see complete files
+// and concurrent writers of the same key just replace each other. A hit
+// bumps the mtimes of what it used, and eviction drops the oldest files
+// once the directory outgrows max_size.
+#define MAKER_AC_MAGIC "mkrac\0\0\0"
+#define MAKER_AC_VERSION 1u
+
+static void cache_path(char *buf, const char *dir, const char *kind, uint64_t name)
+{
+    snprintf(buf, PATH_MAX, "%s/%s/%016llx", dir, kind, (unsigned long long)name);
+}
+
+bool maker::Action_Cache::open(const char *cache_dir)
+{
+    char buf[PATH_MAX];
+    dir = heap_strdup(cache_dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+    snprintf(buf, sizeof(buf), "%s/ac", dir);
+    if (mkdir(buf, 0755) != 0 && errno != EEXIST) return false;
+    snprintf(buf, sizeof(buf), "%s/cas", dir);
+    if (mkdir(buf, 0755) != 0 && errno != EEXIST) return false;
+    snprintf(buf, sizeof(buf), "%s/mf", dir);
+    if (mkdir(buf, 0755) != 0 && errno != EEXIST) return false;
+    snprintf(buf, sizeof(buf), "%s/lock", dir);
+    if (mkdir(buf, 0755) != 0 && errno != EEXIST) return false;
+    return true;
+}
+
+// On a hit the outputs are written out and replay gets the captured output
+// of the original run. Any missing or damaged piece makes it a miss.
+bool maker::Action_Cache::lookup(uint64_t key, const char *const *outputs, size_t count, Proc_Result &replay)
+{
+    char entry_path[PATH_MAX];
+    char blob_path[PATH_MAX];
+    cache_path(entry_path, dir, "ac", key);
+
+    List<char> entry;
+    size_t header = 16 + 24 * count + 8;
+    bool ok = read_entire_file(entry_path, entry) && entry.length >= header
+        && temp::strncmp(entry.items, MAKER_AC_MAGIC, 8) == 0
+        && deps_get32(entry.items + 8) == MAKER_AC_VERSION
+        && deps_get32(entry.items + 12) == count;
+    size_t out_len = ok ? deps_get32(entry.items + header - 8) : 0;
+    size_t err_len = ok ? deps_get32(entry.items + header - 4) : 0;
+    ok = ok && entry.length == header + out_len + err_len;
+
+    List<char> blob;
+    for (size_t idx = 0; ok && idx < count; ++idx)
+    {
+        const char *rec = entry.items + 16 + 24 * idx;
+        uint64_t hash, size;
+        __builtin_memcpy(&hash, rec, 8);
+        __builtin_memcpy(&size, rec + 8, 8);
+        cache_path(blob_path, dir, "cas", hash);
+        blob.length = 0;
+        ok = read_entire_file(blob_path, blob) && blob.length == size
+            && hash_bytes(blob.items ? blob.items : "", blob.length) == hash
+            && write_entire_file(outputs[idx], blob.items, blob.length)
+            && chmod(outputs[idx], deps_get32(rec + 16)) == 0;
+        if (ok) utimensat(AT_FDCWD, blob_path, nullptr, 0);
+    }
+    blob.release();
+
+    if (ok)
+    {
+        utimensat(AT_FDCWD, entry_path, nullptr, 0);
+        replay = Proc_Result{};
+        replay.exit_code = 0;
+        replay.out.append(entry.items + header, out_len);
+        replay.err.append(entry.items + header + out_len, err_len);
+        hits++;
+    }
+    else misses++;
+    entry.release();
+    return ok;
+}
+
+bool maker::Action_Cache::store(uint64_t key, const char *const *outputs, size_t count, const Proc_Result &result)
+{
+    if (!result.ok()) return false;
+
+    char path[PATH_MAX];
+    List<char> entry;
+    entry.append(MAKER_AC_MAGIC, 8);
+    deps_put32(entry, MAKER_AC_VERSION);
+    deps_put32(entry, (uint32_t)count);
+
+    List<char> blob;
+    bool ok = true;
+    for (size_t idx = 0; ok && idx < count; ++idx)
+    {
+        struct stat st;
+        blob.length = 0;
+        ok = read_entire_file(outputs[idx], blob) && stat(outputs[idx], &st) == 0;
+        if (!ok) break;
+        uint64_t hash = hash_bytes(blob.items ? blob.items : "", blob.length);
+        uint64_t size = blob.length;
+        cache_path(path, dir, "cas", hash);
+        if (access(path, F_OK) != 0)
+        {
+            ok = write_entire_file(path, blob.items, blob.length);
+            added += size;
+        }
+        entry.append((const char *)&hash, 8);
+        entry.append((const char *)&size, 8);
+        deps_put32(entry, st.st_mode & 07777);
+        deps_put32(entry, 0);
+    }
+    blob.release();
+
+    if (ok)
+    {
+        deps_put32(entry, (uint32_t)result.out.length);
+        deps_put32(entry, (uint32_t)result.err.length);
+        entry.append(result.out.items, result.out.length);
+        entry.append(result.err.items, result.err.length);
+        cache_path(path, dir, "ac", key);
+        ok = write_entire_file(path, entry.items, entry.length);
+        added += entry.length;
+    }
+    entry.release();
+
+    // Walking the whole directory is not free, so only check the size
+    // after every max_size / 16 bytes this process has added.
+    if (added > max_size / 16)
+    {
+        evict();
+        added = 0;
+    }
+    return ok;
+}
+
+#define MAKER_MF_MAGIC "mkrmf\0\0\0"
+#define MAKER_MF_VERSION 1u
+#define MAKER_MF_SETS 8
+
+static uint64_t manifest_key(uint64_t key, maker::String_View path, uint64_t hash)
+{
+    key = maker::hash_bytes(path.data, path.len, key);
+    return maker::hash_bytes(&hash, sizeof(hash), key);
+}
+
+struct Manifest_Header
+{
+    uint64_t hash;
+    uint64_t mtime;
+    uint64_t size;
+    maker::String_View path;
+};
+
+// Reads the header at pos of a manifest set, returning the position after
+// it or 0 when it runs past the end.
+static size_t manifest_header(const maker::List<char> &manifest, size_t pos, Manifest_Header &header)
+{
+    if (pos + 28 > manifest.length) return 0;
+    __builtin_memcpy(&header.hash, manifest.items + pos, 8);
+    __builtin_memcpy(&header.mtime, manifest.items + pos + 8, 8);
+    __builtin_memcpy(&header.size, manifest.items + pos + 16, 8);
+    header.path.data = manifest.items + pos + 28;
+    header.path.len = deps_get32(manifest.items + pos + 24);
+    pos += 28 + header.path.len;
+    return pos <= manifest.length ? pos : 0;
+}
+
+static size_t manifest_sets(const maker::List<char> &manifest)
+{
+    if (manifest.length < 16 || maker::temp::strncmp(manifest.items, MAKER_MF_MAGIC, 8) != 0
+        || deps_get32(manifest.items + 8) != MAKER_MF_VERSION) return 0;
+    return deps_get32(manifest.items + 12);
+}
+
+// Direct mode: the key of a command that has a depfile only covers what is
+// known before running it. The manifest for that key keeps the header sets
+// of the last few runs (most recent first), each with the full key its
+// results were stored under. When every header of a set is unchanged that
+// key can be used without running the preprocessor; a header whose mtime
+// and size match the manifest is taken as unchanged without being read.
+// Returns 0 when no set matches.
+uint64_t maker::Action_Cache::direct_key(uint64_t key, Stat_Cache &stats)
+{
+    char path[PATH_MAX];
+    cache_path(path, dir, "mf", key);
+    List<char> manifest;
+    if (!read_entire_file(path, manifest)) return 0;
+
+    size_t sets = manifest_sets(manifest);
+    size_t pos = 16;
+    uint64_t found = 0;
+    for (size_t set = 0; set < sets && found == 0 && pos + 12 <= manifest.length; ++set)
+    {
+        uint64_t full;
+        __builtin_memcpy(&full, manifest.items + pos, 8);
+        size_t count = deps_get32(manifest.items + pos + 8);
+        pos += 12;
+
+        bool ok = true;
+        for (size_t idx = 0; pos != 0 && idx < count; ++idx)
+        {
+            Manifest_Header header;
+            pos = manifest_header(manifest, pos, header);
+            if (pos == 0 || !ok) continue;
+            File_Stat st = stats.get(header.path);
+            ok = st.exists && ((st.mtime == header.mtime && st.size == header.size)
+                || stats.hash(header.path) == header.hash);
+        }
+        if (pos == 0) break;
+        if (ok) found = full;
+    }
+    manifest.release();
+    return found;
+}
+
+// Puts the headers a run just read at the front of the manifest for key and
+// returns the full key to store the results under.
+uint64_t maker::Action_Cache::record_manifest(uint64_t key, const String_View *headers, size_t count, Stat_Cache &stats)
+{
+    uint64_t full = key;
+    List<char> set;
+    set.append((const char *)&full, 8);
+    deps_put32(set, (uint32_t)count);
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        File_Stat st = stats.get(headers[idx]);
+        uint64_t hash = stats.hash(headers[idx]);
+        set.append((const char *)&hash, 8);
+        set.append((const char *)&st.mtime, 8);
+        set.append((const char *)&st.size, 8);
+        deps_put32(set, (uint32_t)headers[idx].len);
+        set.append(headers[idx].data, headers[idx].len);
+        full = manifest_key(full, headers[idx], hash);
+    }
+    __builtin_memcpy(set.items, &full, 8);
+
+    char path[PATH_MAX];
+    cache_path(path, dir, "mf", key);
+    List<char> old;
+    read_entire_file(path, old);
+    size_t old_sets = manifest_sets(old);
+
+    List<char> manifest;
+    manifest.append(MAKER_MF_MAGIC, 8);
+    deps_put32(manifest, MAKER_MF_VERSION);
+    deps_put32(manifest, 1);
+    manifest.append(set.items, set.length);
+
+    size_t pos = 16;
+    size_t kept = 1;
+    for (size_t idx = 0; idx < old_sets && kept < MAKER_MF_SETS && pos + 12 <= old.length; ++idx)
+    {
+        size_t start = pos;
+        uint64_t other;
+        __builtin_memcpy(&other, old.items + pos, 8);
+        size_t headers_in_set = deps_get32(old.items + pos + 8);
+        pos += 12;
+        Manifest_Header header;
+        for (size_t hdr = 0; pos != 0 && hdr < headers_in_set; ++hdr)
+            pos = manifest_header(old, pos, header);
+        if (pos == 0) break;
+        if (other == full) continue;
+        manifest.append(old.items + start, pos - start);
+        kept++;
+    }
+    uint32_t sets = (uint32_t)kept;
+    __builtin_memcpy(manifest.items + 12, &sets, 4);
+
+    bool ok = write_entire_file(path, manifest.items, manifest.length);
+    added += manifest.length;
+    manifest.release();
+    old.release();
+    set.release();
+    return ok ? full : 0;
+}
+
+// Takes the lock for running the action under key, blocking or not. The
+// fd is the lock; -1 (errno EWOULDBLOCK when another process holds it) if
+// it could not be taken. A lock taken on a file its holder has unlinked in
+// the meantime is stale and is taken again on the new one.
+int maker::Action_Cache::lock(uint64_t key, bool wait)
+{
+    char path[PATH_MAX];
+    cache_path(path, dir, "lock", key);
+    for (;;)
+    {
+        int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        int rc;
+        while ((rc = flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB))) != 0 && errno == EINTR);
+        if (rc != 0)
+        {
+            int saved = errno;
+            ::close(fd);
+            errno = saved;
+            return -1;
+        }
+        struct stat held, named;
+        if (fstat(fd, &held) == 0 && ::stat(path, &named) == 0 &&
+            held.st_dev == named.st_dev && held.st_ino == named.st_ino) return fd;
+        ::close(fd);
+    }
+}
+
+// The file is removed while still locked, so lock/ does not fill up with
+// one file per action ever run; whoever was blocked on it starts over.
+void maker::Action_Cache::unlock(uint64_t key, int fd)
+{
+    char path[PATH_MAX];
+    cache_path(path, dir, "lock", key);
+    unlink(path);
+    ::close(fd);
+}
+
+struct Cache_File
+{
+    char *path;
+    uint64_t size;
+    uint64_t mtime;
+};
+
+static int compare_cache_file(const void *lhs, const void *rhs)
+{
+    uint64_t a = ((const Cache_File *)lhs)->mtime;
+    uint64_t b = ((const Cache_File *)rhs)->mtime;
+    return a < b ? -1 : a > b;
+}
+
+// Least recently used first, removes files until the cache is down to 3/4
+// of max_size so the next few stores do not trigger another walk.
+void maker::Action_Cache::evict()
+{
+    List<Cache_File> files;
+    uint64_t total = 0;
+    const char *kinds[] = { "ac", "cas", "mf" };
+    char buf[PATH_MAX];
+
+    for (size_t kind = 0; kind < 3; ++kind)
+    {
+        snprintf(buf, sizeof(buf), "%s/%s", dir, kinds[kind]);
+        DIR *handle = opendir(buf);
+        if (!handle) continue;
+        while (struct dirent *ent = readdir(handle))
+        {
+            if (ent->d_name[0] == '.') continue;
+            snprintf(buf, sizeof(buf), "%s/%s/%s", dir, kinds[kind], ent->d_name);
+            File_Stat st = stat_file(buf);
+            if (!st.exists) continue;
+            Cache_File file;
+            file.path = heap_strdup(buf);
+            file.size = st.size;
+            file.mtime = st.mtime;
+            files.push(file);
+            total += st.size;
+        }
+        closedir(handle);
+    }
+
+    if (total > max_size)
+    {
+        qsort(files.items, files.length, sizeof(Cache_File), compare_cache_file);
+        for (size_t idx = 0; idx < files.length && total > max_size / 4 * 3; ++idx)
+            if (unlink(files.items[idx].path) == 0) total -= files.items[idx].size;
+    }
+
+    for (size_t idx = 0; idx < files.length; ++idx) free(files.items[idx].path);
+    files.release();
+}
+
+void maker::Action_Cache::close()
+{
+    free(dir);
+    dir = nullptr;
+    added = 0;
+}
+
+// A minimal HTTP/1.1 client and server for the remote action cache, laid
+// out like bazel-remote: GET/PUT /ac/<key> and /cas/<hash>. Bodies always
+// carry a Content-Length; connections are kept alive and requests are
+// pipelined, at most MAKER_HTTP_WINDOW in flight so neither side can end up
+// blocked writing while the other is too.
+#define MAKER_HTTP_WINDOW 16
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool http_fill(int fd, maker::List<char> &inbox)
+{
+    char chunk[64 * 1024];
+    for (;;)
+    {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        inbox.append(chunk, (size_t)n);
+        return true;
+    }
+}
+
+// Reads one message off fd: head gets the start line and headers, body
+// exactly Content-Length bytes. Whatever follows stays in inbox for the
+// next pipelined message.
+static bool http_read(int fd, maker::List<char> &inbox, maker::List<char> &head, maker::List<char> &body)
+{
+    size_t end = 0;
+    for (size_t scanned = 0;; )
+    {
+        for (; scanned + 4 <= inbox.length; ++scanned)
+            if (maker::temp::strncmp(inbox.items + scanned, "\r\n\r\n", 4) == 0) break;
+        if (scanned + 4 <= inbox.length)
+        {
+            end = scanned;
+            break;
+        }
+        if (!http_fill(fd, inbox)) return false;
+    }
+
+    size_t length = 0;
+    for (size_t line = 0; line < end; )
+    {
+        size_t next = line;
+        while (next < end && inbox.items[next] != '\r') next++;
+        const char *name = "content-length:";
+        size_t idx = 0;
+        while (name[idx] && line + idx < next && tolower(inbox.items[line + idx]) == name[idx]) idx++;
+        if (!name[idx])
+            for (size_t c = line + idx; c < next; ++c)
+                if (isdigit(inbox.items[c])) length = length * 10 + (size_t)(inbox.items[c] - '0');
+        line = next + 2;
+    }
+
+    size_t total = end + 4 + length;
+    while (inbox.length < total)
+        if (!http_fill(fd, inbox)) return false;
+
+    head.length = 0;
+    head.append(inbox.items, end);
+    head.push('\0');
+    body.length = 0;
+    body.append(inbox.items + end + 4, length);
+    __builtin_memmove(inbox.items, inbox.items + total, inbox.length - total);
+    inbox.length -= total;
+    return true;
+}
+
+static maker::String_View http_field(const maker::List<char> &head, size_t n)
+{
+    maker::String_View sv;
+    sv.data = head.items;
+    sv.len = head.length > 0 ? head.length - 1 : 0;
+    maker::String_View line = sv.chop('\r');
+    maker::String_View field = line.chop(' ');
+    for (size_t idx = 0; idx < n; ++idx) field = line.chop(' ');
+    return field;
+}
+
+static char *heap_strndup(const char *str, size_t len)
+{
+    char *copy = (char *)malloc(len + 1);
+    ASSERT(copy != nullptr, "out of memory");
+    __builtin_memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// url is http://host[:port][/prefix]; nothing is sent until the first
+// request.
+bool maker::Remote_Cache::open(const char *url)
+{
+    if (temp::strncmp(url, "http://", 7) != 0) return false;
+    const char *cursor = url + 7;
+    size_t len = 0;
+    while (cursor[len] && cursor[len] != ':' && cursor[len] != '/') len++;
+    host = heap_strndup(cursor, len);
+    cursor += len;
+
+    if (*cursor == ':')
+    {
+        cursor++;
+        len = 0;
+        while (cursor[len] && cursor[len] != '/') len++;
+        port = heap_strndup(cursor, len);
+        cursor += len;
+    }
+    else port = heap_strdup("80");
+
+    len = temp::strlen(cursor);
+    while (len > 0 && cursor[len - 1] == '/') len--;
+    prefix = heap_strndup(cursor, len);
+    return host[0] != '\0';
+}
+
+// timeout bounds the connect and every send and recv, so a stuck or
+// unreachable server costs a failed fetch rather than a hung build. On
+// Linux SO_SNDTIMEO covers connect() too, hence setting it up front.
+static int http_connect(const char *host, const char *port, double timeout)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addrs = nullptr;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0) return -1;
+
+    timeval tv;
+    tv.tv_sec = (time_t)timeout;
+    tv.tv_usec = (suseconds_t)((timeout - (double)tv.tv_sec) * 1e6);
+    int fd = -1;
+    for (addrinfo *addr = addrs; addr && fd < 0; addr = addr->ai_next)
+    {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+// Pipelines one request per name. Requests that fail on a kept-alive
+// connection the server may have dropped are retried once on a new one;
+// failing on a fresh connection (timeouts included) gives up.
+static bool remote_exchange(maker::Remote_Cache &remote, const char *method, const char *kind,
+                            const uint64_t *names, const maker::List<char> *bodies_in, size_t count,
+                            maker::List<char> *bodies_out, bool *found)
+{
+    using namespace maker;
+
+    List<char> head, body, request;
+    size_t sent = 0;
+    size_t received = 0;
+    bool reused = remote.fd >= 0;
+    bool ok = true;
+
+    while (received < count)
+    {
+        if (remote.fd < 0)
+        {
+            remote.fd = http_connect(remote.host, remote.port, remote.timeout);
+            remote.inbox.length = 0;
+            sent = received;
+            if (remote.fd < 0)
+            {
+                ok = false;
+                break;
+            }
+        }
+
+        bool alive = true;
+        for (; alive && sent < count && sent - received < MAKER_HTTP_WINDOW; ++sent)
+        {
+            char line[512];
+            size_t len = bodies_in ? bodies_in[sent].length : 0;
+            int n = snprintf(line, sizeof(line), "%s %s/%s/%016llx HTTP/1.1\r\nHost: %s\r\nContent-Length: %zu\r\n\r\n",
+                             method, remote.prefix, kind, (unsigned long long)names[sent], remote.host, len);
+            request.length = 0;
+            request.append(line, (size_t)n);
+            if (bodies_in) request.append(bodies_in[sent].items, len);
+            alive = send_all(remote.fd, request.items, request.length);
+        }
+
+        if (alive) alive = http_read(remote.fd, remote.inbox, head, body);
+        if (!alive)
+        {
+            close(remote.fd);
+            remote.fd = -1;
+            if (!reused)
+            {
+                ok = false;
+                break;
+            }
+            reused = false;
+            continue;
+        }
+
+        String_View status = http_field(head, 1);
+        bool hit = status == "200";
+        if (found) found[received] = hit;
+        if (!hit && (!found || status != "404")) ok = false;
+        if (bodies_out && hit)
+        {
+            bodies_out[received].length = 0;
+            bodies_out[received].append(body.items, body.length);
+        }
+        received++;
+    }
+
+    head.release();
+    body.release();
+    request.release();
+    return ok;
+}
+
+bool maker::Remote_Cache::get_many(const char *kind, const uint64_t *names, size_t count, List<char> *bodies, bool *found)
+{
+    for (size_t idx = 0; idx < count; ++idx) found[idx] = false;
+    return remote_exchange(*this, "GET", kind, names, nullptr, count, bodies, found);
+}
+
+bool maker::Remote_Cache::put_many(const char *kind, const uint64_t *names, const List<char> *bodies, size_t count)
+{
+    return remote_exchange(*this, "PUT", kind, names, bodies, count, nullptr, nullptr);
+}
+
+void maker::Remote_Cache::close()
+{
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    free(host);
+    free(port);
+    free(prefix);
+    host = port = prefix = nullptr;
+    inbox.release();
+}
+
+// Maps "/ac/<hex>" or "/cas/<hex>" into dir; anything else is refused.
+static bool cache_target(const char *dir, maker::String_View target, char *path)
+{
+    if (target.len == 0 || target.data[0] != '/') return false;
+    target.chop_left(1);
+    maker::String_View kind = target.chop('/');
+    if (!(kind == "ac" || kind == "cas") || target.len == 0 || target.len > 64) return false;
+    for (size_t idx = 0; idx < target.len; ++idx)
+        if (!isxdigit(target.data[idx])) return false;
+    snprintf(path, PATH_MAX, "%s/%.*s/%.*s", dir, (int)kind.len, kind.data, (int)target.len, target.data);
+    return true;
+}
+
+struct Cache_Connection
+{
+    char *dir;
+    int fd;
+};
+
+static void *serve_connection(void *arg)
+{
+    using namespace maker;
+
+    Cache_Connection *conn = (Cache_Connection *)arg;
+    List<char> inbox, head, body;
+    char path[PATH_MAX];
+
+    while (http_read(conn->fd, inbox, head, body))
+    {
+        String_View method = http_field(head, 0);
+        int status = cache_target(conn->dir, http_field(head, 1), path) ? 405 : 400;
+        if (status == 405 && method == "GET")
+        {
+            body.length = 0;
+            status = read_entire_file(path, body) ? 200 : 404;
+        }
+        else if (status == 405 && method == "PUT")
+        {
+            status = write_entire_file(path, body.items, body.length) ? 200 : 500;
+            body.length = 0;
+        }
+        if (status != 200) body.length = 0;
+
+        char line[128];
+        const char *reason = status == 200 ? "OK" : status == 404 ? "Not Found"
+            : status == 400 ? "Bad Request" : status == 405 ? "Method Not Allowed" : "Internal Server Error";
+        int n = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n\r\n", status, reason, body.length);
+        if (!send_all(conn->fd, line, (size_t)n) || !send_all(conn->fd, body.items, body.length)) break;
+        if (status == 400 || status == 405) break;
+    }
+
+    close(conn->fd);
+    free(conn->dir);
+    free(conn);
+    inbox.release();
+    head.release();
+    body.release();
+    return nullptr;
+}
+
+// Binds to the loopback interface; port 0 picks a free one, which is then
+// left in port.
+bool maker::Cache_Server::listen(const char *cache_dir, int want_port)
+{
+    char buf[PATH_MAX];
+    dir = heap_strdup(cache_dir);
+    const char *kinds[] = { "", "/ac", "/cas" };
+    for (size_t idx = 0; idx < 3; ++idx)
+    {
+        snprintf(buf, sizeof(buf), "%s%s", dir, kinds[idx]);
+        if (mkdir(buf, 0755) != 0 && errno != EEXIST) return false;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return false;
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)want_port);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0
+        || ::listen(listen_fd, 64) != 0
+        || getsockname(listen_fd, (sockaddr *)&addr, &len) != 0) return false;
+    port = ntohs(addr.sin_port);
+    return true;
+}
+
+// Serves until stop(), one thread per connection.
+void maker::Cache_Server::run()
+{
+    for (;;)
+    {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0 && errno == EINTR) continue;
+        if (fd < 0) break;
+
+        Cache_Connection *conn = (Cache_Connection *)malloc(sizeof(Cache_Connection));
+        ASSERT(conn != nullptr, "out of memory");
+        conn->dir = heap_strdup(dir);
+        conn->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, serve_connection, conn) != 0)
+        {
+            close(fd);
+            free(conn->dir);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listen_fd);
+    listen_fd = -1;
+    free(dir);
+    dir = nullptr;
+}
+
+void maker::Cache_Server::stop()
+{
+    if (listen_fd >= 0) shutdown(listen_fd, SHUT_RDWR);
+}
+
+// Manifests share the remote's ac namespace under a derived key.
+static uint64_t remote_manifest_key(uint64_t key)
+{
+    return maker::hash_bytes("mf", 2, key);
+}
+
+static bool entry_blobs(const maker::List<char> &entry, maker::List<uint64_t> &hashes)
+{
+    if (entry.length < 16 || maker::temp::strncmp(entry.items, MAKER_AC_MAGIC, 8) != 0
+        || deps_get32(entry.items + 8) != MAKER_AC_VERSION) return false;
+    size_t count = deps_get32(entry.items + 12);
+    if (entry.length < 16 + 24 * count + 8) return false;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        uint64_t hash;
+        __builtin_memcpy(&hash, entry.items + 16 + 24 * idx, 8);
+        hashes.push(hash);
+    }
+    return true;
+}
+
+// Copies the given action entries and the blobs they need (that are not
+// here yet) from the remote into the local cache. Blobs go first and are
+// checked against their names, so a local lookup afterwards sees either a
+// complete entry or none.
+void maker::Action_Cache::pull_actions(const uint64_t *keys, size_t count, bool *found)
+{
+    for (size_t idx = 0; idx < count; ++idx) found[idx] = false;
+    if (!remote || count == 0) return;
+
+    char path[PATH_MAX];
+    List<List<char>> entries;
+    for (size_t idx = 0; idx < count; ++idx) entries.push(List<char>{});
+    remote->get_many("ac", keys, count, entries.items, found);
+
+    List<uint64_t> hashes, missing;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        hashes.length = 0;
+        if (found[idx] && !entry_blobs(entries.items[idx], hashes)) found[idx] = false;
+        for (size_t blob = 0; blob < hashes.length; ++blob)
+        {
+            cache_path(path, dir, "cas", hashes.items[blob]);
+            if (access(path, F_OK) != 0) missing.push(hashes.items[blob]);
+        }
+    }
+
+    List<List<char>> blobs;
+    List<bool> have;
+    for (size_t idx = 0; idx < missing.length; ++idx)
+    {
+        blobs.push(List<char>{});
+        have.push(false);
+    }
+    remote->get_many("cas", missing.items, missing.length, blobs.items, have.items);
+    for (size_t idx = 0; idx < missing.length; ++idx)
+    {
+        List<char> &blob = blobs.items[idx];
+        if (!have.items[idx] || hash_bytes(blob.items ? blob.items : "", blob.length) != missing.items[idx]) continue;
+        cache_path(path, dir, "cas", missing.items[idx]);
+        write_entire_file(path, blob.items, blob.length);
+    }
+
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        hashes.length = 0;
+        if (!found[idx] || !entry_blobs(entries.items[idx], hashes)) continue;
+        for (size_t blob = 0; found[idx] && blob < hashes.length; ++blob)
+        {
+            cache_path(path, dir, "cas", hashes.items[blob]);
+            found[idx] = access(path, F_OK) == 0;
+        }
+        cache_path(path, dir, "ac", keys[idx]);
+        if (found[idx]) found[idx] = write_entire_file(path, entries.items[idx].items, entries.items[idx].length);
+    }
+
+    for (size_t idx = 0; idx < entries.length; ++idx) entries.items[idx].release();
+    for (size_t idx = 0; idx < blobs.length; ++idx) blobs.items[idx].release();
+    entries.release();
+    blobs.release();
+    have.release();
+    hashes.release();
+    missing.release();
+}
+
+void maker::Action_Cache::pull_manifests(const uint64_t *keys, size_t count, bool *found)
+{
+    for (size_t idx = 0; idx < count; ++idx) found[idx] = false;
+    if (!remote || count == 0) return;
+
+    List<uint64_t> names;
+    List<List<char>> manifests;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        names.push(remote_manifest_key(keys[idx]));
+        manifests.push(List<char>{});
+    }
+    remote->get_many("ac", names.items, count, manifests.items, found);
+
+    char path[PATH_MAX];
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        cache_path(path, dir, "mf", keys[idx]);
+        if (found[idx]) found[idx] = write_entire_file(path, manifests.items[idx].items, manifests.items[idx].length);
+        manifests.items[idx].release();
+    }
+    names.release();
+    manifests.release();
+}
+
+void maker::Action_Cache::push_action(uint64_t key)
+{
+    if (!remote) return;
+
+    char path[PATH_MAX];
+    List<char> entry;
+    List<uint64_t> hashes;
+    List<List<char>> blobs;
+    cache_path(path, dir, "ac", key);
+    bool ok = read_entire_file(path, entry) && entry_blobs(entry, hashes);
+    for (size_t idx = 0; ok && idx < hashes.length; ++idx)
+    {
+        cache_path(path, dir, "cas", hashes.items[idx]);
+        ok = read_entire_file(path, blobs.push(List<char>{}));
+    }
+    if (ok) ok = remote->put_many("cas", hashes.items, blobs.items, blobs.length);
+    if (ok) remote->put_many("ac", &key, &entry, 1);
+
+    for (size_t idx = 0; idx < blobs.length; ++idx) blobs.items[idx].release();
+    blobs.release();
+    hashes.release();
+    entry.release();
+}
+
+void maker::Action_Cache::push_manifest(uint64_t key)
+{
+    if (!remote) return;
+
+    char path[PATH_MAX];
+    List<char> manifest;
+    cache_path(path, dir, "mf", key);
+    uint64_t name = remote_manifest_key(key);
+    if (read_entire_file(path, manifest)) remote->put_many("ac", &name, &manifest, 1);
+    manifest.release();
+}
+
+// The remote side of a build runs on its own thread: the graph keeps
+// scheduling local jobs while fetches are in flight. Each round takes
+// everything queued so far and pipelines it, fetches before uploads;
+// finished fetches go to done and wake_fd (an eventfd) is bumped.
+static void *remote_worker(void *arg)
+{
+    using namespace maker;
+
+    Remote_Queue &queue = *(Remote_Queue *)arg;
+    List<Remote_Job> batch;
+    List<uint64_t> keys;
+    List<bool> found;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.pending.length == 0 && !queue.stopping)
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        if (queue.pending.length == 0)
+        {
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+        batch.length = 0;
+        batch.append(queue.pending.items, queue.pending.length);
+        queue.pending.length = 0;
+        pthread_mutex_unlock(&queue.lock);
+
+        Remote_Kind gets[] = { REMOTE_GET_ACTION, REMOTE_GET_MANIFEST };
+        for (size_t kind = 0; kind < 2; ++kind)
+        {
+            keys.length = 0;
+            found.length = 0;
+            for (size_t idx = 0; idx < batch.length; ++idx)
+                if (batch.items[idx].kind == gets[kind])
+                {
+                    keys.push(batch.items[idx].key);
+                    found.push(false);
+                }
+            if (keys.length == 0) continue;
+
+            if (gets[kind] == REMOTE_GET_ACTION) queue.cache->pull_actions(keys.items, keys.length, found.items);
+            else queue.cache->pull_manifests(keys.items, keys.length, found.items);
+            for (size_t idx = 0, n = 0; idx < batch.length; ++idx)
+                if (batch.items[idx].kind == gets[kind]) batch.items[idx].found = found.items[n++];
+        }
+
+        for (size_t idx = 0; idx < batch.length; ++idx)
+        {
+            if (batch.items[idx].kind == REMOTE_PUT_ACTION) queue.cache->push_action(batch.items[idx].key);
+            if (batch.items[idx].kind == REMOTE_PUT_MANIFEST) queue.cache->push_manifest(batch.items[idx].key);
+        }
+
+        pthread_mutex_lock(&queue.lock);
+        for (size_t idx = 0; idx < batch.length; ++idx)
+            if (batch.items[idx].kind == REMOTE_GET_ACTION || batch.items[idx].kind == REMOTE_GET_MANIFEST)
+                queue.done.push(batch.items[idx]);
+        pthread_mutex_unlock(&queue.lock);
+        uint64_t one = 1;
+        while (write(queue.wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+
+    batch.release();
+    keys.release();
+    found.release();
+    return nullptr;
+}
+
+bool maker::Remote_Queue::start(Action_Cache *remote_cache)
+{
+    cache = remote_cache;
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) return false;
+    started = pthread_create(&thread, nullptr, remote_worker, this) == 0;
+    if (!started)
+    {
+        ::close(wake_fd);
+        wake_fd = -1;
+    }
+    return started;
+}
+
+void maker::Remote_Queue::push(const Remote_Job &job)
+{
+    pthread_mutex_lock(&lock);
+    pending.push(job);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// Drops the fetches for rule that the worker has not picked up yet and
+// returns how many there were.
+size_t maker::Remote_Queue::cancel(size_t rule)
+{
+    pthread_mutex_lock(&lock);
+    size_t dropped = 0;
+    for (size_t idx = pending.length; idx-- > 0; )
+    {
+        Remote_Job &job = pending.items[idx];
+        if (job.rule != rule || (job.kind != REMOTE_GET_ACTION && job.kind != REMOTE_GET_MANIFEST)) continue;
+        pending.remove(idx);
+        dropped++;
+    }
+    pthread_mutex_unlock(&lock);
+    return dropped;
+}
+
+// One thread waits on every lock held by another process: each round tries
+// them all without blocking and sleeps up to 50ms in between (new waits
+// wake it early). Polling rather than blocking in flock() also lets stop()
+// call the waits off instead of joining a thread stuck on a process that
+// may never finish.
+static void *lock_waiter(void *arg)
+{
+    using namespace maker;
+
+    Remote_Queue &queue = *(Remote_Queue *)arg;
+    List<Remote_Job> waiting;
+    for (;;)
+    {
+        pthread_mutex_lock(&queue.lock);
+        if (waiting.length == 0)
+        {
+            while (queue.lock_pending.length == 0 && !queue.stopping)
+                pthread_cond_wait(&queue.lock_cond, &queue.lock);
+        }
+        else if (queue.lock_pending.length == 0 && !queue.stopping)
+        {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 50 * 1000 * 1000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&queue.lock_cond, &queue.lock, &deadline);
+        }
+        bool stopping = queue.stopping;
+        waiting.append(queue.lock_pending.items, queue.lock_pending.length);
+        queue.lock_pending.length = 0;
+        pthread_mutex_unlock(&queue.lock);
+        if (stopping) break;
+
+        bool any = false;
+        for (size_t idx = waiting.length; idx-- > 0; )
+        {
+            Remote_Job job = waiting.items[idx];
+            job.fd = queue.cache->lock(job.key, false);
+            if (job.fd < 0 && errno == EWOULDBLOCK) continue;
+            job.found = job.fd >= 0;
+            waiting.remove(idx);
+            pthread_mutex_lock(&queue.lock);
+            queue.done.push(job);
+            pthread_mutex_unlock(&queue.lock);
+            any = true;
+        }
+        if (!any) continue;
+        uint64_t one = 1;
+        while (write(queue.wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+
+    waiting.release();
+    return nullptr;
+}
+
+// Waits for another process to let go of the lock for key, off the build
+// thread (see lock_waiter), so the build goes on meanwhile. The lock comes
+// back through pop() as a REMOTE_LOCK job holding the fd. Not remote at
+// all, but it shares the wake-up path with the fetches.
+void maker::Remote_Queue::wait_lock(size_t rule, uint64_t key)
+{
+    Remote_Job job;
+    job.kind = REMOTE_LOCK;
+    job.rule = rule;
+    job.key = key;
+    pthread_mutex_lock(&lock);
+    lock_pending.push(job);
+    pthread_cond_broadcast(&lock_cond);
+    pthread_mutex_unlock(&lock);
+    if (lock_started) return;
+    lock_started = pthread_create(&lock_thread, nullptr, lock_waiter, this) == 0;
+    ASSERT(lock_started, "could not start lock waiter");
+}
+
+bool maker::Remote_Queue::pop(Remote_Job &job)
+{
+    if (!started) return false;
+    uint64_t count;
+    while (read(wake_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&lock);
+    bool any = done.length > 0;
+    if (any) job = done.items[--done.length];
+    pthread_mutex_unlock(&lock);
+    return any;
+}
+
+void maker::Remote_Queue::wait()
+{
+    pollfd pfd = {};
+    pfd.fd = wake_fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+}
+
+// Lets the worker finish what is queued (uploads included) and joins it.
+// Locks still waited on are given up (a build that stopped early does not
+// wait on other processes); locks nobody picked up are let go.
+void maker::Remote_Queue::stop()
+{
+    if (!started) return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_cond_broadcast(&lock_cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, nullptr);
+    if (lock_started) pthread_join(lock_thread, nullptr);
+    lock_started = false;
+    lock_pending.release();
+    for (size_t idx = 0; idx < done.length; ++idx)
+        if (done.items[idx].kind == REMOTE_LOCK && done.items[idx].fd >= 0)
+            cache->unlock(done.items[idx].key, done.items[idx].fd);
+
+    ::close(wake_fd);
+    wake_fd = -1;
+    pending.release();
+    done.release();
+    started = false;
+    stopping = false;
+}
+
+maker::Rule &maker::Rule::input(const char *path)
+{
+    inputs.push(path);
+    return *this;
+}
+
+maker::Rule &maker::Rule::output(const char *path)
+{
+    outputs.push(path);
+    return *this;
+}
+
+// The returned reference is only good until the next call to rule().
+maker::Rule &maker::Graph::rule(const Command &cmd)
+{
+    Rule rule;
+    rule.cmd = cmd;
+    return rules.push(rule);
+}
+
+static void mark_needed(maker::Graph &graph, size_t idx)
+{
+    maker::Rule &rule = graph.rules.items[idx];
+    if (rule.needed) return;
+    rule.needed = true;
+    for (size_t in = 0; in < rule.inputs.length; ++in)
+    {
+        size_t *producer = graph.producers.find(rule.inputs.items[in]);
+        if (producer) mark_needed(graph, *producer);
+    }
+}
+
+// An ignored flag matches the argument itself and its "flag=value" form;
+// a trailing '*' makes it a plain prefix ("-j*" also covers "-j8").
+static bool flag_ignored(const maker::Graph &graph, const char *arg)
+{
+    for (size_t idx = 0; idx < graph.ignored_flags.length; ++idx)
+    {
+        const char *flag = graph.ignored_flags.items[idx];
+        size_t len = maker::temp::strlen(flag);
+        if (len > 0 && flag[len - 1] == '*')
+        {
+            if (maker::temp::strncmp(arg, flag, len - 1) == 0) return true;
+        }
+        else if (maker::temp::strncmp(arg, flag, len) == 0 && (arg[len] == '\0' || arg[len] == '=')) return true;
+    }
+    return false;
+}
+
+// Identifies a command line across runs: the arguments in order, each
+// terminated so that {"ab", "c"} and {"a", "bc"} differ, then the working
+// directory and the env delta. Arguments starting with one of the graph's
+// ignored_flags do not count.
+static uint64_t command_hash(const maker::Graph &graph, const maker::Command &cmd)
+{
+    using maker::hash_bytes;
+    using maker::temp::strlen;
+
+    uint64_t hash = 0;
+    for (size_t idx = 0; idx < cmd.length && cmd.items[idx]; ++idx)
+        if (!flag_ignored(graph, cmd.items[idx]))
+            hash = hash_bytes(cmd.items[idx], strlen(cmd.items[idx]) + 1, hash);
+    if (cmd.cwd) hash = hash_bytes(cmd.cwd, strlen(cmd.cwd) + 1, hash ^ 1);
+    for (size_t idx = 0; cmd.env && idx < cmd.env->length; ++idx)
+        hash = hash_bytes(cmd.env->items[idx], strlen(cmd.env->items[idx]) + 1, hash ^ 2);
+    return hash;
+}
+
+static void finish_rule(maker::Graph &graph, maker::Rule &rule, maker::List<size_t> &ready)
+{
+    rule.state = maker::RULE_DONE;
+    for (size_t dep = 0; dep < rule.dependents.length; ++dep)
+    {
+        size_t next = rule.dependents.items[dep];
+        if (--graph.rules.items[next].pending == 0) ready.push(next);
+    }
+}
+
+// Newest mtime among the inputs of rule and the headers the deps log has
+// recorded for it, UINT64_MAX when one of them does not exist.
+static uint64_t newest_input(maker::Graph &graph, maker::Rule &rule)
+{
+    using namespace maker;
+
+    uint64_t newest = 0;
+    for (size_t in = 0; in < rule.inputs.length; ++in)
+    {
+        File_Stat st = graph.stats.get(rule.inputs.items[in]);
+        if (!st.exists) return UINT64_MAX;
+        if (st.mtime > newest) newest = st.mtime;
+    }
+
+    const Deps_Record *rec = graph.deps && rule.depfile && rule.outputs.length > 0
+        ? graph.deps->lookup(rule.outputs.items[0]) : nullptr;
+    for (size_t idx = 0; rec && idx < rec->count; ++idx)
+    {
+        File_Stat st = graph.stats.get(graph.deps->paths.items[graph.deps->dep_ids.items[rec->first + idx]]);
+        if (!st.exists) return UINT64_MAX;
+        if (st.mtime > newest) newest = st.mtime;
+    }
+    return newest;
+}
+
+// A rule is dirty when an output is missing or older than its newest input
+// (recorded headers included). With a build db it is also dirty when an
+// output has no entry or one made by a different command line; an output
+// whose mtime was kept back by early cutoff counts as built at the input
+// mtime recorded alongside it. A rule with a depfile is dirty until the
+// deps log has something for it.
+static bool rule_dirty(maker::Graph &graph, maker::Rule &rule)
+{
+    using namespace maker;
+
+    if (rule.outputs.length == 0) return true;
+    if (graph.deps && rule.depfile && !graph.deps->lookup(rule.outputs.items[0])) return true;
+    uint64_t newest = newest_input(graph, rule);
+    if (newest == UINT64_MAX) return true;
+
+    uint64_t hash = graph.db ? command_hash(graph, rule.cmd) : 0;
+    for (size_t out = 0; out < rule.outputs.length; ++out)
+    {
+        File_Stat st = graph.stats.get(rule.outputs.items[out]);
+        if (!st.exists) return true;
+        uint64_t built = st.mtime;
+        if (graph.db)
+        {
+            const Build_Entry *entry = graph.db->lookup(rule.outputs.items[out]);
+            if (!entry || entry->cmd_hash != hash) return true;
+            if (entry->mtime == st.mtime && entry->input_mtime > built) built = entry->input_mtime;
+        }
+        if (newest > built) return true;
+    }
+    return false;
+}
+
+static bool set_file_mtime(const char *path, uint64_t mtime)
+{
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = (time_t)(mtime / 1000000000ull);
+    times[1].tv_nsec = (long)(mtime % 1000000000ull);
+    return utimensat(AT_FDCWD, path, times, 0) == 0;
+}
+
+// Records the outputs of a rule that just ran. For early cutoff an output
+// that came out byte-identical to the last build gets its old mtime back,
+// so rules downstream see nothing new; input_mtime keeps the rule itself
+// from looking stale next time.
+static void record_outputs(maker::Graph &graph, maker::Rule &rule, double wall_time)
+{
+    using namespace maker;
+
+    uint64_t hash = command_hash(graph, rule.cmd);
+    uint64_t newest = newest_input(graph, rule);
+    for (size_t out = 0; out < rule.outputs.length; ++out)
+    {
+        const char *path = rule.outputs.items[out];
+        File_Stat st = graph.stats.get(path);
+        const Build_Entry *old = graph.db->lookup(path);
+        Build_Entry entry;
+        entry.cmd_hash = hash;
+        entry.mtime = st.mtime;
+        entry.input_mtime = newest == UINT64_MAX ? 0 : newest;
+        entry.duration = (uint64_t)(wall_time * 1e9);
+        // Replayed from the cache: keep what running it locally used to cost.
+        if (wall_time == 0 && old) entry.duration = old->duration;
+
+        if (graph.early_cutoff && st.exists)
+        {
+            entry.content_hash = graph.stats.hash(path);
+            if (old && old->content_hash == entry.content_hash && old->mtime != 0
+                && old->mtime < st.mtime && set_file_mtime(path, old->mtime))
+                entry.mtime = graph.stats.refresh(path).mtime;
+        }
+        graph.db->record(path, entry);
+    }
+}
+
+static void rule_succeeded(maker::Graph &graph, maker::Rule &rule, double wall_time)
+{
+    rule.ran = true;
+    for (size_t out = 0; out < rule.outputs.length; ++out)
+        graph.stats.refresh(rule.outputs.items[out]);
+    if (graph.deps && rule.depfile && rule.outputs.length > 0)
+        graph.deps->ingest(rule.depfile, rule.outputs.items[0]);
+    if (graph.db) record_outputs(graph, rule, wall_time);
+}
+
+// Key of a rule in the action cache: its command hash plus the path and
+// content of every input; 0 when the rule cannot be cached. For a rule
+// with a depfile this is only the direct mode manifest key.
+static uint64_t action_key(maker::Graph &graph, maker::Rule &rule)
+{
+    using namespace maker;
+
+    if (rule.outputs.length == 0) return 0;
+    uint64_t key = command_hash(graph, rule.cmd);
+    for (size_t in = 0; in < rule.inputs.length; ++in)
+    {
+        const char *path = rule.inputs.items[in];
+        if (!graph.stats.get(path).exists) return 0;
+        uint64_t content = graph.stats.hash(path);
+        key = hash_bytes(path, temp::strlen(path) + 1, key);
+        key = hash_bytes(&content, sizeof(content), key);
+    }
+    return key;
+}
+
+// The depfile travels with the outputs so a hit can be ingested like a run.
+static void cached_paths(maker::Rule &rule, maker::List<const char *> &paths)
+{
+    paths.append(rule.outputs.items, rule.outputs.length);
+    if (rule.depfile) paths.push(rule.depfile);
+}
+
+// Stores the results of a rule that just ran; for a rule with a depfile
+// the headers it lists go into the manifest and the full key.
+static void store_cached(maker::Graph &graph, maker::Rule &rule, const maker::Proc_Result &result, maker::Remote_Queue &remote)
+{
+    using namespace maker;
+
+    uint64_t key = rule.key;
+    if (rule.depfile)
+    {
+        List<char> text;
+        Depfile parsed;
+        String_View sv;
+        key = 0;
+        if (read_entire_file(rule.depfile, text))
+        {
+            sv.data = text.items;
+            sv.len = text.length;
+            if (parsed.parse(sv))
+                key = graph.cache->record_manifest(rule.key, parsed.deps.items, parsed.deps.length, graph.stats);
+        }
+        parsed.release();
+        text.release();
+        if (key == 0) return;
+    }
+
+    List<const char *> paths;
+    cached_paths(rule, paths);
+    bool stored = graph.cache->store(key, paths.items, paths.length, result);
+    paths.release();
+    if (!stored || !remote.started || !graph.cache->remote) return;
+
+    Remote_Job job;
+    job.kind = REMOTE_PUT_ACTION;
+    job.key = key;
+    remote.push(job);
+    if (rule.depfile)
+    {
+        job.kind = REMOTE_PUT_MANIFEST;
+        job.key = rule.key;
+        remote.push(job);
+    }
+}
+
+// Replays the local cache entry under key for rule, if there is one.
+static bool replay_entry(maker::Graph &graph, maker::Rule &rule, maker::Job_Pool &pool, uint64_t key)
+{
+    using namespace maker;
+
+    List<const char *> paths;
+    cached_paths(rule, paths);
+    Proc_Result replay;
+    bool hit = graph.cache->lookup(key, paths.items, paths.length, replay);
+    paths.release();
+    if (!hit) return false;
+    if (pool.echo_output)
+    {
+        write_all(STDOUT_FILENO, replay.out);
+        write_all(STDERR_FILENO, replay.err);
+    }
+    replay.release();
+    rule_succeeded(graph, rule, 0);
+    return true;
+}
+
+// Looks a dirty rule up in the action cache, once per build. On a hit its
+// outputs are already in place and the output of the original run has been
+// replayed. On a local miss with a remote attached, a fetch is queued and
+// the rule is left RULE_FETCHING until the answer comes back.
+static bool replay_cached(maker::Graph &graph, maker::Rule &rule, size_t idx, maker::Job_Pool &pool, maker::Remote_Queue &remote)
+{
+    using namespace maker;
+
+    if (!graph.cache || rule.cache_checked) return false;
+    rule.cache_checked = true;
+    rule.key = action_key(graph, rule);
+    if (rule.key == 0) return false;
+
+    uint64_t key = rule.depfile ? graph.cache->direct_key(rule.key, graph.stats) : rule.key;
+    if (key != 0 && replay_entry(graph, rule, pool, key)) return true;
+    if (remote.started && graph.cache->remote)
+    {
+        Remote_Job job;
+        job.kind = key != 0 ? REMOTE_GET_ACTION : REMOTE_GET_MANIFEST;
+        job.rule = idx;
+        job.key = key != 0 ? key : rule.key;
+        remote.push(job);
+        rule.state = RULE_FETCHING;
+    }
+    return false;
+}
+
+// A fetch came back: replays what it brought if it was enough, follows a
+// manifest up with a fetch of the action it points to, and otherwise hands
+// the rule back to be run. Returns true when the rule is done.
+static bool fetch_finished(maker::Graph &graph, maker::Remote_Job job, maker::Job_Pool &pool, maker::Remote_Queue &remote)
+{
+    using namespace maker;
+
+    Rule &rule = graph.rules.items[job.rule];
+    rule.state = RULE_WAITING;
+    if (job.kind == REMOTE_GET_MANIFEST && job.found)
+    {
+        job.key = graph.cache->direct_key(rule.key, graph.stats);
+        if (job.key == 0) return false;
+        if (replay_entry(graph, rule, pool, job.key)) return true;
+        job.kind = REMOTE_GET_ACTION;
+        job.found = false;
+        remote.push(job);
+        rule.state = RULE_FETCHING;
+        return false;
+    }
+    return job.kind == REMOTE_GET_ACTION && job.found && replay_entry(graph, rule, pool, job.key);
+}
+
+// Whether a rule waiting on a remote fetch should also be started locally:
+// only when the build db says it used to take less than race_below seconds.
+static bool should_race(maker::Graph &graph, maker::Rule &rule)
+{
+    if (graph.race_below <= 0 || !graph.db || rule.outputs.length == 0) return false;
+    const maker::Build_Entry *entry = graph.db->lookup(rule.outputs.items[0]);
+    return entry && entry->duration > 0 && entry->duration <= (uint64_t)(graph.race_below * 1e9);
+}
+
+// A fetch for a rule that is also running locally came back with something.
+// A manifest is followed up with a fetch of its action (returns true); an
+// action means the fetch won: the local job is cancelled, and the entry gets
+// replayed once the job has exited so nothing it writes on the way out can
+// clobber the outputs.
+static bool race_fetched(maker::Graph &graph, maker::Rule &rule, maker::Remote_Job job,
+                         maker::Job_Pool &pool, maker::Remote_Queue &remote)
+{
+    using namespace maker;
+
+    if (job.kind == REMOTE_GET_MANIFEST)
+    {
+        job.key = graph.cache->direct_key(rule.key, graph.stats);
+        if (job.key == 0) return false;
+        job.kind = REMOTE_GET_ACTION;
+        job.found = false;
+        remote.push(job);
+        return true;
+    }
+    rule.won_key = job.key;
+    pool.cancel(rule.job);
+    return false;
+}
+
+// Makes rule the one run of its action key, within this build (leaders
+// holds the rules that are) and across processes sharing the cache (the
+// lock file). Returns false when it has to wait instead: either on a rule
+// of this build, parked until that one is through, or on another process,
+// in which case the lock comes back through the remote queue. Either way
+// the rule looks in the cache again once woken.
+static bool claim_action(maker::Graph &graph, maker::Rule &rule, size_t idx,
+                         maker::List<size_t> &leaders, maker::Remote_Queue &remote)
+{
+    using namespace maker;
+
+    if (!graph.cache || rule.key == 0) return true;
+    for (size_t at = 0; at < leaders.length; ++at)
+    {
+        if (leaders.items[at] == idx) return true;
+        if (graph.rules.items[leaders.items[at]].key != rule.key) continue;
+        rule.state = RULE_BLOCKED;
+        rule.leader = leaders.items[at];
+        return false;
+    }
+    if (rule.lock_fd < 0)
+    {
+        rule.lock_fd = graph.cache->lock(rule.key, false);
+        if (rule.lock_fd < 0 && errno == EWOULDBLOCK && remote.started)
+        {
+            remote.wait_lock(idx, rule.key);
+            rule.state = RULE_BLOCKED;
+            rule.leader = idx;
+            return false;
+        }
+    }
+    leaders.push(idx);
+    return true;
+}
+
+// Rule idx is through, one way or another: lets go of its lock and sends
+// the rules parked behind it back to ready. Returns how many there were.
+static size_t release_action(maker::Graph &graph, size_t idx, maker::List<size_t> &leaders,
+                             maker::List<size_t> &parked, maker::List<size_t> &ready)
+{
+    using namespace maker;
+
+    Rule &rule = graph.rules.items[idx];
+    if (rule.lock_fd >= 0)
+    {
+        graph.cache->unlock(rule.key, rule.lock_fd);
+        rule.lock_fd = -1;
+    }
+    for (size_t at = 0; at < leaders.length; ++at)
+        if (leaders.items[at] == idx)
+        {
+            leaders.remove(at);
+            break;
+        }
+
+    size_t woken = 0;
+    for (size_t at = parked.length; at-- > 0; )
+    {
+        Rule &waiter = graph.rules.items[parked.items[at]];
+        if (waiter.leader != idx) continue;
+        waiter.state = RULE_WAITING;
+        waiter.cache_checked = false;
+        ready.push(parked.items[at]);
+        parked.remove(at);
+        woken++;
+    }
+    return woken;
+}
+
+// Runs every rule (or just what target needs) through the pool as soon as
+// the rules producing its inputs are done. Inputs nobody produces are taken
+// to be sources. Completions are picked up from pool.results, which also
+// covers jobs reaped inside submit() while it waited for a free slot.
+// Rules whose outputs are newer than all their inputs are skipped; stats
+// are cached for the run and refreshed for the outputs of every rule that
+// ran. With a db attached, every output of a rule that ran gets its command
+// hash, content hash, mtime and duration recorded (see record_outputs for
+// early cutoff). With an action cache attached, dirty rules are looked up
+// before they are run and stored after they succeed; if the cache has a
+// remote, local misses are fetched and results uploaded on a background
+// thread while other rules keep running. With race_below set, rules the db
+// knows to be quick are started locally while their fetch is in flight, and
+// whichever finishes first wins. Identical actions (same action cache key)
+// run once: the rest wait for it, whether it runs in this build or in
+// another process on the same cache, and then replay it from the cache.
+// Returns false if any rule failed or a dependency cycle was found.
+bool maker::Graph::build(Job_Pool &pool, const char *target)
+{
+    if (pool.max_jobs == 0) pool.max_jobs = cpu_count();
+    pool.cancelled = false;
+
+    producers.release();
+    for (size_t idx = 0; idx < rules.length; ++idx)
+    {
+        Rule &rule = rules.items[idx];
+        rule.dependents.length = 0;
+        rule.pending = 0;
+        rule.needed = target == nullptr;
+        rule.state = RULE_WAITING;
+        for (size_t out = 0; out < rule.outputs.length; ++out)
+            producers.insert(rule.outputs.items[out], idx);
+    }
+
+    if (target)
+    {
+        size_t *producer = producers.find(target);
+        if (!producer) return false;
+        mark_needed(*this, *producer);
+    }
+
+    stats.release();
+    List<String_View> paths;
+    for (size_t idx = 0; idx < rules.length; ++idx)
+    {
+        Rule &rule = rules.items[idx];
+        if (!rule.needed) continue;
+        for (size_t in = 0; in < rule.inputs.length; ++in) paths.push(rule.inputs.items[in]);
+        for (size_t out = 0; out < rule.outputs.length; ++out) paths.push(rule.outputs.items[out]);
+
+        const Deps_Record *rec = deps && rule.depfile && rule.outputs.length > 0
+            ? deps->lookup(rule.outputs.items[0]) : nullptr;
+        for (size_t dep = 0; rec && dep < rec->count; ++dep)
+            paths.push(deps->paths.items[deps->dep_ids.items[rec->first + dep]]);
+    }
+    stats.prefetch(paths.items, paths.length);
+    paths.release();
+
+    List<size_t> ready;
+    for (size_t idx = 0; idx < rules.length; ++idx)
+    {
+        Rule &rule = rules.items[idx];
+        rule.ran = false;
+        rule.key = 0;
+        rule.cache_checked = false;
+        rule.racing = false;
+        rule.won_key = 0;
+        rule.lock_fd = -1;
+        if (!rule.needed) continue;
+        for (size_t in = 0; in < rule.inputs.length; ++in)
+        {
+            size_t *producer = producers.find(rule.inputs.items[in]);
+            if (!producer || *producer == idx) continue;
+            rules.items[*producer].dependents.push(idx);
+            rule.pending++;
+        }
+        if (rule.pending == 0) ready.push(idx);
+    }
+
+    Remote_Queue remote;
+    if (cache && remote.start(cache)) pool.procs.wake_on(remote.wake_fd);
+
+    List<size_t> job_rule;
+    List<size_t> leaders;
+    List<size_t> parked;
+    size_t first_job = pool.submitted;
+    size_t seen = pool.results.length;
+    size_t running = 0;
+    size_t fetching = 0;
+    size_t blocked = 0;
+    bool ok = true;
+
+    for (;;)
+    {
+        for (; seen < pool.results.length; ++seen)
+        {
+            Job_Result &res = pool.results.items[seen];
+            if (res.id < first_job) continue;
+            size_t idx = job_rule.items[res.id - first_job];
+            Rule &rule = rules.items[idx];
+            running--;
+
+            if (rule.racing)
+            {
+                rule.racing = false;
+                fetching -= remote.cancel(idx);
+                uint64_t won = rule.won_key;
+                rule.won_key = 0;
+                if (won != 0 && !res.ok())
+                {
+                    if (replay_entry(*this, rule, pool, won)) finish_rule(*this, rule, ready);
+                    else
+                    {
+                        rule.state = RULE_WAITING;
+                        ready.push(idx);
+                    }
+                    continue;
+                }
+            }
+
+            if (!res.ok())
+            {
+                rule.state = RULE_FAILED;
+                ok = false;
+                blocked -= release_action(*this, idx, leaders, parked, ready);
+                continue;
+            }
+
+            if (cache && rule.key != 0) store_cached(*this, rule, res.proc, remote);
+            blocked -= release_action(*this, idx, leaders, parked, ready);
+            rule_succeeded(*this, rule, res.proc.wall_time);
+            finish_rule(*this, rule, ready);
+        }
+
+        Remote_Job job;
+        while (remote.pop(job))
+        {
+            Rule &rule = rules.items[job.rule];
+            if (job.kind == REMOTE_LOCK)
+            {
+                blocked--;
+                rule.lock_fd = job.fd;
+                rule.state = RULE_WAITING;
+                rule.cache_checked = false;
+                ready.push(job.rule);
+                continue;
+            }
+            fetching--;
+            if (rule.state == RULE_FETCHING)
+            {
+                if (fetch_finished(*this, job, pool, remote))
+                {
+                    blocked -= release_action(*this, job.rule, leaders, parked, ready);
+                    finish_rule(*this, rule, ready);
+                }
+                else if (rule.state == RULE_FETCHING) fetching++;
+                else ready.push(job.rule);
+            }
+            else if (rule.racing && rule.won_key == 0 && job.found)
+            {
+                if (race_fetched(*this, rule, job, pool, remote)) fetching++;
+            }
+        }
+
+        bool stop = !ok && !keep_going;
+        if (!stop && ready.length > 0)
+        {
+            size_t idx = ready.items[ready.length - 1];
+            Rule &rule = rules.items[idx];
+            if (!rule_dirty(*this, rule) || replay_cached(*this, rule, idx, pool, remote))
+            {
+                ready.length--;
+                blocked -= release_action(*this, idx, leaders, parked, ready);
+                finish_rule(*this, rule, ready);
+                continue;
+            }
+            if (rule.state == RULE_FETCHING)
+            {
+                ready.length--;
+                fetching++;
+                if (should_race(*this, rule) && pool.running.length < pool.max_jobs)
+                {
+                    rule.state = RULE_RUNNING;
+                    rule.racing = true;
+                    rule.job = pool.submitted;
+                    job_rule.push(idx);
+                    pool.submit(rule.cmd);
+                    running++;
+                }
+                continue;
+            }
+            if (!claim_action(*this, rule, idx, leaders, remote))
+            {
+                ready.length--;
+                blocked++;
+                if (rule.leader != idx) parked.push(idx);
+                continue;
+            }
+        }
+        if (!stop && ready.length > 0 && pool.running.length < pool.max_jobs)
+        {
+            size_t idx = ready.items[--ready.length];
+            Rule &rule = rules.items[idx];
+            rule.state = RULE_RUNNING;
+            job_rule.push(idx);
+            pool.submit(rule.cmd);
+            running++;
+            continue;
+        }
+
+        // Rules parked behind a leader that will never run now are given up on.
+        if (running == 0 && fetching == 0 && (blocked == 0 || stop)) break;
+        if (running == 0) remote.wait();
+        else pool.wait_one();
+    }
+
+    if (remote.started)
+    {
+        pool.procs.wake_on(-1);
+        remote.stop();
+    }
+
+    for (size_t idx = 0; idx < rules.length; ++idx)
+    {
+        Rule &rule = rules.items[idx];
+        if (rule.needed && rule.state != RULE_DONE) ok = false;
+        if (rule.lock_fd >= 0) cache->unlock(rule.key, rule.lock_fd);
+        rule.lock_fd = -1;
+    }
+
+    job_rule.release();
+    leaders.release();
+    parked.release();
+    ready.release();
+    return ok;
+}
+
+void maker::Graph::release()
+{
+    for (size_t idx = 0; idx < rules.length; ++idx)
+    {
+        rules.items[idx].inputs.release();
+        rules.items[idx].outputs.release();
+        rules.items[idx].dependents.release();
+    }
+    rules.release();
+    producers.release();
+    stats.release();
+    ignored_flags.release();
+}
+
+void maker::Job_Pool::release()
+{
+    jobserver.close();
+    jobserver_ready = false;
+    cancelled = false;
+    procs.release();
+    running.release();
+    for (size_t idx = 0; idx < results.length; ++idx)
+        results.items[idx].proc.release();
+    results.release();
+}
+
+thread_local char maker::Temp_Buffer::buffer[];
+thread_local maker::Temp_Buffer maker::tmp_buffer;
+
+constexpr size_t item_size = sizeof(char*);
+
+template<typename T>
+constexpr inline void swap(T &val1, T &val2)
+{
+    val1 ^= val2;
+    val2 ^= val1;
+    val1 ^= val2;
+}
+
+void maker::Temp_Buffer::save()
+{
+    save_point = idx;
+}
+
+void maker::Temp_Buffer::load()
+{
+    swap(idx, save_point);
+}
+
+char *maker::Temp_Buffer::alloc(size_t n)
+{
+    ASSERT(idx + n <= start_size, "increase static storage size LOL");
+    size_t start_pos = idx;
+    idx += n;
+    return &buffer[start_pos];
+}
+
+void *maker::Temp_Buffer::resize_buffer(void *ptr, size_t old_n, size_t new_n)
+{
+    if (!ptr) return nullptr;
+    if (old_n >= new_n) return ptr;
+
+    char *new_buf = alloc(new_n);
+    char *src = (char *)ptr;
+
+    for (size_t idx = 0; idx < old_n; ++idx)
+        new_buf[idx] = src[idx];
+
+    return new_buf;
+}
+
+void maker::Command::resize()
+{
+    if (capacity == 0)
+    {
+        capacity = 4;
+        items = (char **) tmp_buffer.alloc(4 * sizeof(char*));
+        return;
+    }
+
+    items = (char **)tmp_buffer.resize_buffer(items, capacity * sizeof(char*), capacity * 2 * sizeof(char*));
+    capacity *= 2;
+}
+
+maker::Command &maker::Command::push(char *cmd)
+{
+    if (length >= capacity || capacity == 0) resize();
+    items[length++] = cmd;
+    return *this;
+}
+
+maker::Command &maker::Command::push_null()
+{
+    return push(nullptr);
+}
+
+maker::Command &maker::Command::redirect_in(const char *path)
+{
+    redirects[STDIN_FILENO] = {-1, path, O_RDONLY};
+    return *this;
+}
+
+maker::Command &maker::Command::redirect_out(const char *path, bool append)
+{
+    redirects[STDOUT_FILENO] = {-1, path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC)};
+    return *this;
+}
+
+maker::Command &maker::Command::redirect_err(const char *path, bool append)
+{
+    redirects[STDERR_FILENO] = {-1, path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC)};
+    return *this;
+}
+
+maker::Command &maker::Command::redirect(int target, int fd)
+{
+    ASSERT(target >= 0 && target < 3, "only stdin, stdout and stderr can be redirected");
+    redirects[target] = {fd, nullptr, 0};
+    return *this;
+}
+
+void maker::Env::resize()
+{
+    if (capacity == 0)
+    {
+        capacity = 4;
+        items = (char **) tmp_buffer.alloc(4 * sizeof(char*));
+        return;
+    }
+
+    items = (char **)tmp_buffer.resize_buffer(items, capacity * sizeof(char*), capacity * 2 * sizeof(char*));
+    capacity *= 2;
+}
+
+// Length of the NAME part of "NAME=value" (or of a bare "NAME").
+static size_t env_name_len(const char *entry)
+{
+    size_t len = 0;
+    while (entry[len] && entry[len] != '=') len++;
+    return len;
+}
+
+static bool env_same_name(const char *left, const char *right)
+{
+    size_t len = env_name_len(left);
+    return len == env_name_len(right) && maker::temp::strncmp(left, right, len) == 0;
+}
+
+static maker::Env &env_push(maker::Env &env, char *entry)
+{
+    size_t kept = 0;
+    for (size_t idx = 0; idx < env.length; ++idx)
+        if (!env_same_name(env.items[idx], entry)) env.items[kept++] = env.items[idx];
+    env.length = kept;
+
+    if (env.length >= env.capacity || env.capacity == 0) env.resize();
+    env.items[env.length++] = entry;
+    env.envp.length = 0;
+    return env;
+}
+
+maker::Env &maker::Env::set(const char *name, const char *value)
+{
+    String_Builder sb;
+    sb.push(name).push('=').push(value).push('\0');
+    return env_push(*this, sb.data);
+}
+
+maker::Env &maker::Env::unset(const char *name)
+{
+    return env_push(*this, temp::strdup(name));
+}
+
+// Cheap fingerprint of the environ array itself (entry pointers only, not
+// their contents), enough to notice setenv/unsetenv since the last build.
+static uint64_t environ_stamp()
+{
+    uint64_t stamp = (uint64_t)(uintptr_t)environ;
+    for (char **entry = environ; entry && *entry; ++entry)
+        stamp = (stamp ^ (uint64_t)(uintptr_t)*entry) * 0x100000001b3ull;
+    return stamp;
+}
+
+// Builds the envp once and hands the same array to every spawn sharing
+// this Env; only the pointers of environ are copied. The array is rebuilt
+// in place when environ changes.
+char **maker::Env::materialize()
+{
+    uint64_t stamp = environ_stamp();
+    if (envp.length > 0 && base_stamp == stamp) return envp.items;
+
+    envp.length = 0;
+    for (char **entry = environ; entry && *entry; ++entry)
+    {
+        bool overridden = false;
+        for (size_t idx = 0; idx < length && !overridden; ++idx)
+            overridden = env_same_name(*entry, items[idx]);
+        if (!overridden) envp.push(*entry);
+    }
+    for (size_t idx = 0; idx < length; ++idx)
+        if (items[idx][env_name_len(items[idx])] == '=') envp.push(items[idx]);
+    envp.push(nullptr);
+
+    base_stamp = stamp;
+    return envp.items;
+}
+
+void maker::Env::release()
+{
+    envp.release();
+    base_stamp = 0;
 }
 
 constexpr size_t maker::temp::strlen(const char *str)
@@ -31,6 +31,20 @@ namespace maker
     }
 };
 
+static void write_file(const char *path, const char *content)
+{
+    FILE *f = std::fopen(path, "w");
+    REQUIRE(f != nullptr);
+    std::fputs(content, f);
+    std::fclose(f);
+}
+
+static bool file_exists(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
 TEST_SUITE_BEGIN("Temp_Buffer");
 TEST_CASE("Allocation"
           * doctest::description("using .alloc and .alloc_count to allocate memory"))
@@ -143,6 +157,152 @@ TEST_CASE("Push"
         }
     }
 }
+
+TEST_CASE("Response file"
+          * doctest::description("oversized commands spill their arguments into @file"))
+{
+    tmp_buffer.save();
+
+    Command cmd;
+    cmd.push((char*)"c++").push((char*)"-E").push((char*)"-P")
+       .push((char*)"-DVALUE=hello world").push((char*)"-x").push((char*)"c").push((char*)"-")
+       .push_null();
+    cmd.response_file = true;
+    cmd.arg_limit = 16;
+
+    Command value;
+    value.push((char*)"sh").push((char*)"-c").push((char*)"echo VALUE").push_null();
+
+    Pipeline pipeline;
+    pipeline.push(value).push(cmd);
+
+    Pipeline_Result res = pipeline.run(true);
+    CHECK(res.ok());
+    const List<char> &out = res.stages.items[1].out;
+    REQUIRE(out.length >= 11);
+    CHECK(std::strncmp(out.items, "hello world", 11) == 0);
+    res.release();
+
+    SUBCASE("many oversized spawns")
+    {
+        Command many;
+        many.push((char*)"true").push((char*)"some").push((char*)"long").push((char*)"arguments").push_null();
+        many.response_file = true;
+        many.arg_limit = 16;
+        size_t used = tmp_buffer.idx;
+        for (size_t idx = 0; idx < 200; ++idx)
+            CHECK(start_process(many).wait().ok());
+        CHECK(tmp_buffer.idx == used);
+    }
+
+    tmp_buffer.load();
+}
+
+TEST_CASE("Redirect"
+          * doctest::description("stdio redirections without a shell"))
+{
+    tmp_buffer.save();
+    char path[] = "/tmp/maker_redirect_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    Command echo;
+    echo.push((char*)"echo").push((char*)"hello").push_null();
+
+    SUBCASE("truncate then append")
+    {
+        CHECK(start_process(echo.redirect_out(path)).wait().ok());
+        CHECK(start_process(echo.redirect_out(path)).wait().ok());
+        CHECK(start_process(echo.redirect_out(path, true)).wait().ok());
+
+        Command cat;
+        cat.push((char*)"cat").push_null();
+        cat.redirect_in(path);
+        Proc_Result res = start_process(cat, SPAWN_CAPTURE).wait();
+        CHECK(res.out.length == 12);
+        res.release();
+    }
+
+    SUBCASE("stderr to stdout")
+    {
+        Command cmd;
+        cmd.push((char*)"sh").push((char*)"-c").push((char*)"echo err >&2").push_null();
+        cmd.redirect_out(path).redirect(STDERR_FILENO, STDOUT_FILENO);
+        CHECK(start_process(cmd).wait().ok());
+
+        struct stat st;
+        REQUIRE(stat(path, &st) == 0);
+        CHECK(st.st_size == 4);
+    }
+
+    SUBCASE("bad target")
+    {
+        CHECK_THROWS(echo.redirect(3, STDOUT_FILENO));
+    }
+
+    unlink(path);
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Env");
+TEST_CASE("Overrides")
+{
+    tmp_buffer.save();
+    setenv("MAKER_TEST_KEEP", "kept", 1);
+    setenv("MAKER_TEST_DROP", "dropped", 1);
+
+    Env env;
+    env.set("MAKER_TEST_SET", "one").set("MAKER_TEST_SET", "two").unset("MAKER_TEST_DROP");
+
+    SUBCASE("child sees the delta")
+    {
+        Command cmd;
+        cmd.push((char*)"sh").push((char*)"-c")
+           .push((char*)"echo \"$MAKER_TEST_KEEP:$MAKER_TEST_SET:${MAKER_TEST_DROP-unset}\"")
+           .push_null();
+        cmd.env = &env;
+        Proc_Result res = start_process(cmd, SPAWN_CAPTURE).wait();
+
+        const char *expected = "kept:two:unset\n";
+        REQUIRE(res.out.length == std::strlen(expected));
+        CHECK(std::strncmp(res.out.items, expected, res.out.length) == 0);
+        res.release();
+    }
+
+    SUBCASE("envp is built once")
+    {
+        char **envp = env.materialize();
+        CHECK(env.materialize() == envp);
+
+        setenv("MAKER_TEST_NEW", "1", 1);
+        char **rebuilt = env.materialize();
+        bool found = false;
+        for (char **entry = rebuilt; *entry; ++entry)
+            if (std::strcmp(*entry, "MAKER_TEST_NEW=1") == 0) found = true;
+        CHECK(found);
+        unsetenv("MAKER_TEST_NEW");
+    }
+
+    SUBCASE("rebuilds reuse their storage")
+    {
+        size_t used = tmp_buffer.idx;
+        for (size_t idx = 0; idx < 200; ++idx)
+        {
+            setenv("MAKER_TEST_NEW", idx % 2 ? "1" : "2", 1);
+            REQUIRE(env.materialize() != nullptr);
+        }
+        CHECK(tmp_buffer.idx == used);
+        unsetenv("MAKER_TEST_NEW");
+    }
+
+    env.release();
+
+    unsetenv("MAKER_TEST_KEEP");
+    unsetenv("MAKER_TEST_DROP");
+    tmp_buffer.load();
+}
 TEST_SUITE_END();
 
 TEST_SUITE_BEGIN("String operations");
@@ -551,6 +711,24 @@ TEST_CASE("comparison")
 
 TEST_SUITE_END();
 
+TEST_SUITE_BEGIN("Hash");
+TEST_CASE("hash_bytes")
+{
+    const char *text = "the quick brown fox jumps over the lazy dog";
+    size_t len = std::strlen(text);
+
+    CHECK(hash_bytes(text, len) == hash_bytes(text, len));
+    CHECK(hash_bytes(text, len) != hash_bytes(text, len, 1));
+    CHECK(hash_bytes(text, len) != hash_bytes(text, len - 1));
+    CHECK(hash_bytes("", 0) != hash_bytes("a", 1));
+
+    char copy[64];
+    std::strcpy(copy, text);
+    copy[20] ^= 1;
+    CHECK(hash_bytes(text, len) != hash_bytes(copy, len));
+}
+TEST_SUITE_END();
+
 TEST_SUITE_BEGIN("String_Builder");
 TEST_CASE("Resize sb"
           * doctest::description("Resizing the internal buffer"))
@@ -626,3 +804,2135 @@ TEST_CASE("Push sb")
     }
 }
 TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Proc");
+TEST_CASE("Wait result")
+{
+    tmp_buffer.save();
+
+    SUBCASE("exit code")
+    {
+        Command cmd;
+        cmd.push((char*)"sh").push((char*)"-c").push((char*)"exit 3").push_null();
+        Proc_Result res = start_process(cmd).wait();
+        CHECK(res.exit_code == 3);
+        CHECK(res.signal == 0);
+        CHECK_FALSE(res.ok());
+    }
+
+    SUBCASE("signal")
+    {
+        Command cmd;
+        cmd.push((char*)"sh").push((char*)"-c").push((char*)"kill -9 $$").push_null();
+        Proc_Result res = start_process(cmd).wait();
+        CHECK(res.exit_code == -1);
+        CHECK(res.signal == 9);
+        CHECK_FALSE(res.ok());
+    }
+
+    SUBCASE("timing and usage")
+    {
+        Command cmd;
+        cmd.push((char*)"sleep").push((char*)"0.1").push_null();
+        Proc_Result res = start_process(cmd).wait();
+        CHECK(res.ok());
+        CHECK(res.wall_time >= 0.1);
+        CHECK(res.max_rss > 0);
+    }
+
+    SUBCASE("no process")
+    {
+        Proc proc;
+        CHECK_FALSE(proc.wait().ok());
+    }
+
+    SUBCASE("captured output")
+    {
+        Command cmd;
+        cmd.push((char*)"sh").push((char*)"-c").push((char*)"echo out; echo err >&2; head -c 200000 /dev/zero").push_null();
+        Proc_Result res = start_process(cmd, SPAWN_CAPTURE).wait();
+        CHECK(res.ok());
+        REQUIRE(res.out.length == 4 + 200000);
+        CHECK(std::strncmp(res.out.items, "out\n", 4) == 0);
+        REQUIRE(res.err.length == 4);
+        CHECK(std::strncmp(res.err.items, "err\n", 4) == 0);
+        res.release();
+    }
+
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("String_Map");
+TEST_CASE("Insert and find")
+{
+    String_Map<int> map;
+    CHECK(map.find("missing") == nullptr);
+
+    char keys[100][8];
+    for (int idx = 0; idx < 100; ++idx)
+    {
+        std::snprintf(keys[idx], sizeof(keys[idx]), "key%d", idx);
+        map.insert(keys[idx], idx);
+    }
+    CHECK(map.count == 100);
+
+    for (int idx = 0; idx < 100; ++idx)
+    {
+        int *value = map.find(keys[idx]);
+        REQUIRE(value != nullptr);
+        CHECK(*value == idx);
+    }
+
+    map.insert("key7", 700);
+    CHECK(map.count == 100);
+    CHECK(*map.find("key7") == 700);
+    CHECK(map.find("key100") == nullptr);
+
+    map.release();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Stat_Cache");
+static void set_mtime(const char *path, time_t sec)
+{
+    struct timespec times[2] = { {sec, 0}, {sec, 0} };
+    REQUIRE(utimensat(AT_FDCWD, path, times, 0) == 0);
+}
+
+TEST_CASE("Staleness")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_stat_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder in, out, missing;
+    in.push(dir).push("/in").push('\0');
+    out.push(dir).push("/out").push('\0');
+    missing.push(dir).push("/missing").push('\0');
+    close(open(in.data, O_CREAT | O_WRONLY, 0644));
+    close(open(out.data, O_CREAT | O_WRONLY, 0644));
+    set_mtime(in.data, 1000);
+    set_mtime(out.data, 2000);
+
+    Stat_Cache stats;
+    const char *ins[] = { in.data };
+    const char *outs[] = { out.data };
+    const char *none[] = { missing.data };
+
+    SUBCASE("up to date")
+    {
+        CHECK_FALSE(stats.needs_rebuild(outs, 1, ins, 1));
+        CHECK(stats.get(in.data).mtime == 1000000000000ull);
+    }
+
+    SUBCASE("newer input")
+    {
+        set_mtime(in.data, 3000);
+        CHECK(stats.needs_rebuild(outs, 1, ins, 1));
+    }
+
+    SUBCASE("missing output or input, phony")
+    {
+        CHECK(stats.needs_rebuild(none, 1, ins, 1));
+        CHECK(stats.needs_rebuild(outs, 1, none, 1));
+        CHECK(stats.needs_rebuild(nullptr, 0, ins, 1));
+    }
+
+    SUBCASE("memoized until refreshed")
+    {
+        CHECK(stats.get(in.data).mtime == 1000000000000ull);
+        set_mtime(in.data, 3000);
+        CHECK(stats.get(in.data).mtime == 1000000000000ull);
+        CHECK(stats.refresh(in.data).mtime == 3000000000000ull);
+        CHECK(stats.entries.count == 1);
+    }
+
+    SUBCASE("prefetch on threads")
+    {
+        stats.threads = 4;
+        List<String_View> paths;
+        for (size_t idx = 0; idx < 300; ++idx)
+            paths.push(idx % 3 == 0 ? in.data : idx % 3 == 1 ? out.data : missing.data);
+        stats.prefetch(paths.items, paths.length);
+        CHECK(stats.entries.count == 3);
+        CHECK(stats.stat_calls == 3);
+        CHECK(stats.get(out.data).mtime == 2000000000000ull);
+        CHECK_FALSE(stats.get(missing.data).exists);
+        stats.prefetch(paths.items, paths.length);
+        CHECK(stats.stat_calls == 3);
+        paths.release();
+    }
+
+    stats.release();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Deps");
+TEST_CASE("Depfile parsing")
+{
+    const char *text =
+        "out.o: src/a.c include/with\\ space.h \\\n"
+        "  cost$$.h\n"
+        "\n"
+        "include/with\\ space.h:\n";
+    Depfile dep;
+    REQUIRE(dep.parse(text));
+
+    REQUIRE(dep.targets.length == 1);
+    CHECK(dep.targets.items[0] == "out.o");
+
+    REQUIRE(dep.deps.length == 3);
+    CHECK(dep.deps.items[0] == "src/a.c");
+    CHECK(dep.deps.items[1] == "include/with space.h");
+    CHECK(dep.deps.items[2] == "cost$.h");
+    CHECK(dep.deps.items[0].data == text + 7);
+    dep.release();
+
+    SUBCASE("CRLF continuations, a truncated one included")
+    {
+        Depfile crlf;
+        REQUIRE(crlf.parse("out.o: a.h \\\r\n b.h \\\r"));
+        REQUIRE(crlf.deps.length == 2);
+        CHECK(crlf.deps.items[0] == "a.h");
+        CHECK(crlf.deps.items[1] == "b.h");
+        crlf.release();
+    }
+}
+
+TEST_CASE("Deps log")
+{
+    tmp_buffer.save();
+    char path[] = "/tmp/maker_deps_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    String_View headers[] = { "a.h", "b.h" };
+    Deps_Log log;
+    REQUIRE(log.open(path));
+    CHECK(log.record("a.o", 42, headers, 2));
+    CHECK(log.record("b.o", 43, headers + 1, 1));
+    log.close();
+
+    SUBCASE("survives a reopen")
+    {
+        REQUIRE(log.open(path));
+        const Deps_Record *rec = log.lookup("a.o");
+        REQUIRE(rec != nullptr);
+        CHECK(rec->mtime == 42);
+        REQUIRE(rec->count == 2);
+        CHECK(log.paths.items[log.dep_ids.items[rec->first + 1]] == "b.h");
+        CHECK(log.lookup("a.h") == nullptr);
+    }
+
+    SUBCASE("torn tail is dropped")
+    {
+        struct stat before;
+        REQUIRE(stat(path, &before) == 0);
+        int fd = open(path, O_WRONLY | O_APPEND);
+        REQUIRE(write(fd, "\x10\0\0\0\x01", 5) == 5);
+        close(fd);
+
+        REQUIRE(log.open(path));
+        CHECK(log.lookup("b.o") != nullptr);
+        struct stat after;
+        REQUIRE(stat(path, &after) == 0);
+        CHECK(after.st_size == before.st_size);
+    }
+
+    SUBCASE("newer record wins")
+    {
+        REQUIRE(log.open(path));
+        CHECK(log.record("a.o", 44, headers, 1));
+        log.close();
+        REQUIRE(log.open(path));
+        const Deps_Record *rec = log.lookup("a.o");
+        REQUIRE(rec != nullptr);
+        CHECK(rec->mtime == 44);
+        CHECK(rec->count == 1);
+    }
+
+    SUBCASE("ingesting many depfiles")
+    {
+        REQUIRE(log.open(path));
+        char dir[] = "/tmp/maker_deps_ingest_XXXXXX";
+        REQUIRE(mkdtemp(dir) != nullptr);
+        size_t used = tmp_buffer.idx;
+        for (size_t idx = 0; idx < 400; ++idx)
+        {
+            char dep[PATH_MAX], out[PATH_MAX];
+            std::snprintf(dep, sizeof(dep), "%s/unit_%zu.d", dir, idx);
+            std::snprintf(out, sizeof(out), "%s/build/objects/unit_%zu.o", dir, idx);
+            write_file(dep, "unit.o: unit.c common.h\n");
+            CHECK(log.ingest(dep, out));
+        }
+        CHECK(tmp_buffer.idx == used);
+        CHECK(log.lookup("/nonexistent") == nullptr);
+        rmdir(dir);
+    }
+
+    log.close();
+    unlink(path);
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Build_DB");
+TEST_CASE("Persistent entries")
+{
+    tmp_buffer.save();
+    char path[] = "/tmp/maker_db_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    Build_DB db;
+    REQUIRE(db.open(path));
+    CHECK(db.lookup("a.o") == nullptr);
+    Build_Entry entry;
+    entry.cmd_hash = 1;
+    entry.content_hash = 2;
+    entry.mtime = 3;
+    entry.duration = 4;
+    CHECK(db.record("a.o", entry));
+    entry.mtime = 5;
+    CHECK(db.record("a.o", entry));
+    CHECK(db.record("dir/longer_than_eight.o", entry));
+    CHECK(db.records == 3);
+    db.close();
+
+    SUBCASE("reopen")
+    {
+        REQUIRE(db.open(path));
+        const Build_Entry *got = db.lookup("a.o");
+        REQUIRE(got != nullptr);
+        CHECK(got->cmd_hash == 1);
+        CHECK(got->content_hash == 2);
+        CHECK(got->mtime == 5);
+        CHECK(got->duration == 4);
+        CHECK(db.lookup("dir/longer_than_eight.o") != nullptr);
+        CHECK(db.entries.count == 2);
+    }
+
+    SUBCASE("torn tail")
+    {
+        struct stat before;
+        REQUIRE(stat(path, &before) == 0);
+        int fd = open(path, O_WRONLY | O_APPEND);
+        REQUIRE(write(fd, "\x30\0\0\0\x03\0\0\0abc", 11) == 11);
+        close(fd);
+
+        REQUIRE(db.open(path));
+        CHECK(db.entries.count == 2);
+        struct stat after;
+        REQUIRE(stat(path, &after) == 0);
+        CHECK(after.st_size == before.st_size);
+    }
+
+    SUBCASE("compaction")
+    {
+        db.compact_min = 2;
+        REQUIRE(db.open(path));
+        for (uint64_t idx = 0; idx < 8; ++idx)
+        {
+            entry.mtime = idx;
+            CHECK(db.record("a.o", entry));
+        }
+        db.close();
+
+        db.compact_min = 2;
+        REQUIRE(db.open(path));
+        CHECK(db.records == 2);
+        CHECK(db.lookup("a.o")->mtime == 7);
+        CHECK(db.record("b.o", entry));
+        db.close();
+
+        REQUIRE(db.open(path));
+        CHECK(db.entries.count == 3);
+    }
+
+    db.close();
+    unlink(path);
+    tmp_buffer.load();
+}
+
+TEST_CASE("Graph records outputs")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_graph_db_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder out, db_path;
+    out.push(dir).push("/out").push('\0');
+    db_path.push(dir).push("/db").push('\0');
+
+    Build_DB db;
+    REQUIRE(db.open(db_path.data));
+    Command touch;
+    touch.push((char*)"touch").push(out.data).push_null();
+    Job_Pool pool(1);
+    Graph graph;
+    graph.db = &db;
+    graph.rule(touch).output(out.data);
+    REQUIRE(graph.build(pool));
+    db.close();
+
+    REQUIRE(db.open(db_path.data));
+    const Build_Entry *entry = db.lookup(out.data);
+    REQUIRE(entry != nullptr);
+    CHECK(entry->cmd_hash != 0);
+    CHECK(entry->mtime == stat_file(out.data).mtime);
+    CHECK(entry->duration > 0);
+
+    graph.release();
+    pool.release();
+    db.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Command line changes")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_cmd_hash_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder out, db_path;
+    out.push(dir).push("/out").push('\0');
+    db_path.push(dir).push("/db").push('\0');
+
+    Build_DB db;
+    REQUIRE(db.open(db_path.data));
+    Command touch;
+    touch.push((char*)"touch").push(out.data).push_null();
+    Job_Pool pool(1);
+    Graph graph;
+    graph.db = &db;
+    graph.rule(touch).output(out.data);
+    REQUIRE(graph.build(pool));
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 1);
+
+    Command changed;
+    changed.push((char*)"touch").push((char*)"-c").push(out.data).push_null();
+    graph.rules.items[0].cmd = changed;
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 2);
+
+    SUBCASE("ignored flags")
+    {
+        graph.ignored_flags.push("-f");
+        graph.ignored_flags.push("--no-deref*");
+        graph.ignored_flags.push("--time");
+        Command noisy;
+        noisy.push((char*)"touch").push((char*)"-c").push((char*)"-f").push((char*)"--no-dereference")
+             .push((char*)"--time=modify").push(out.data).push_null();
+        graph.rules.items[0].cmd = noisy;
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 2);
+    }
+
+    SUBCASE("env delta")
+    {
+        Env env;
+        env.set("MAKER_CMD_HASH", "1");
+        graph.rules.items[0].cmd.env = &env;
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 3);
+        graph.rules.items[0].cmd.env = nullptr;
+        env.release();
+    }
+
+    SUBCASE("survives a reopen")
+    {
+        db.close();
+        REQUIRE(db.open(db_path.data));
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 2);
+    }
+
+    graph.release();
+    pool.release();
+    db.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Early cutoff")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_cutoff_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder src, mid, final_out, db_path;
+    src.push(dir).push("/src").push('\0');
+    mid.push(dir).push("/mid").push('\0');
+    final_out.push(dir).push("/final").push('\0');
+    db_path.push(dir).push("/db").push('\0');
+    write_file(src.data, "message Foo {}\n");
+    set_mtime(src.data, 1000);
+
+    Build_DB db;
+    REQUIRE(db.open(db_path.data));
+    Command gen, use;
+    gen.push((char*)"cp").push(src.data).push(mid.data).push_null();
+    use.push((char*)"cp").push(mid.data).push(final_out.data).push_null();
+    Job_Pool pool(2);
+    Graph graph;
+    graph.db = &db;
+    graph.rule(gen).input(src.data).output(mid.data);
+    graph.rule(use).input(mid.data).output(final_out.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 2);
+    uint64_t mid_mtime = stat_file(mid.data).mtime;
+
+    write_file(src.data, "message Foo {}\n");
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 3);
+    CHECK(stat_file(mid.data).mtime == mid_mtime);
+
+    SUBCASE("stays clean")
+    {
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 3);
+    }
+
+    SUBCASE("real change goes through")
+    {
+        write_file(src.data, "message Foo { int32 x = 1; }\n");
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 5);
+        CHECK(stat_file(mid.data).mtime > mid_mtime);
+    }
+
+    SUBCASE("disabled")
+    {
+        graph.early_cutoff = false;
+        write_file(src.data, "message Foo {}\n");
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 5);
+    }
+
+    graph.release();
+    pool.release();
+    db.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Action_Cache");
+TEST_CASE("Store and lookup")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_ac_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder cache_dir, out, tool;
+    cache_dir.push(dir).push("/cache").push('\0');
+    out.push(dir).push("/out").push('\0');
+    tool.push(dir).push("/tool").push('\0');
+    write_file(out.data, "object code");
+    write_file(tool.data, "#!/bin/sh\n");
+    REQUIRE(chmod(tool.data, 0755) == 0);
+
+    Action_Cache cache;
+    REQUIRE(cache.open(cache_dir.data));
+    const char *outputs[] = { out.data, tool.data };
+    Proc_Result result;
+    result.exit_code = 0;
+    result.out.append("compiled\n", 9);
+    result.err.append("warning\n", 8);
+    REQUIRE(cache.store(42, outputs, 2, result));
+    result.release();
+    unlink(out.data);
+    unlink(tool.data);
+
+    Proc_Result replay;
+    SUBCASE("hit")
+    {
+        REQUIRE(cache.lookup(42, outputs, 2, replay));
+        CHECK(cache.hits == 1);
+        List<char> content;
+        REQUIRE(read_entire_file(out.data, content));
+        REQUIRE(content.length == 11);
+        CHECK(std::strncmp(content.items, "object code", 11) == 0);
+        content.release();
+        REQUIRE(replay.out.length == 9);
+        CHECK(std::strncmp(replay.out.items, "compiled\n", 9) == 0);
+        REQUIRE(replay.err.length == 8);
+        CHECK(std::strncmp(replay.err.items, "warning\n", 8) == 0);
+        struct stat st;
+        REQUIRE(stat(tool.data, &st) == 0);
+        CHECK((st.st_mode & 0777) == 0755);
+    }
+
+    SUBCASE("miss")
+    {
+        CHECK_FALSE(cache.lookup(43, outputs, 2, replay));
+        CHECK_FALSE(cache.lookup(42, outputs, 1, replay));
+        CHECK(cache.misses == 2);
+        CHECK_FALSE(file_exists(out.data));
+    }
+
+    SUBCASE("failed runs are not stored")
+    {
+        Proc_Result failed;
+        failed.exit_code = 1;
+        CHECK_FALSE(cache.store(44, outputs, 0, failed));
+        CHECK_FALSE(cache.lookup(44, outputs, 0, replay));
+    }
+
+    SUBCASE("eviction")
+    {
+        cache.max_size = 1;
+        cache.evict();
+        CHECK_FALSE(cache.lookup(42, outputs, 2, replay));
+    }
+
+    replay.release();
+    cache.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Graph replays cached actions")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_ac_graph_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder cache_dir, src, out, script;
+    cache_dir.push(dir).push("/cache").push('\0');
+    src.push(dir).push("/src").push('\0');
+    out.push(dir).push("/out").push('\0');
+    script.push("cp ").push(src.data).push(' ').push(out.data).push('\0');
+    write_file(src.data, "v1");
+
+    Action_Cache cache;
+    REQUIRE(cache.open(cache_dir.data));
+    Command cp;
+    cp.push((char*)"sh").push((char*)"-c").push(script.data).push_null();
+    Job_Pool pool(1);
+    Graph graph;
+    graph.cache = &cache;
+    graph.rule(cp).input(src.data).output(out.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 1);
+
+    SUBCASE("deleted output comes back from the cache")
+    {
+        unlink(out.data);
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 1);
+        CHECK(cache.hits == 1);
+        CHECK(file_exists(out.data));
+    }
+
+    SUBCASE("changed input misses")
+    {
+        write_file(src.data, "v2");
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 2);
+        CHECK(cache.hits == 0);
+
+        write_file(src.data, "v1");
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 2);
+        CHECK(cache.hits == 1);
+    }
+
+    graph.release();
+    pool.release();
+    cache.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Direct mode")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_direct_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder cache_dir, src, hdr, obj, dep;
+    cache_dir.push(dir).push("/cache").push('\0');
+    src.push(dir).push("/a.c").push('\0');
+    hdr.push(dir).push("/a.h").push('\0');
+    obj.push(dir).push("/a.o").push('\0');
+    dep.push(dir).push("/a.d").push('\0');
+    write_file(hdr.data, "#define VALUE 1\n");
+    write_file(src.data, "#include \"a.h\"\nint value = VALUE;\n");
+
+    Command cc;
+    cc.push((char*)"cc").push((char*)"-c").push(src.data).push((char*)"-o").push(obj.data)
+      .push((char*)"-MMD").push((char*)"-MF").push(dep.data).push_null();
+
+    Action_Cache cache;
+    REQUIRE(cache.open(cache_dir.data));
+    Job_Pool pool(1);
+    Graph graph;
+    graph.cache = &cache;
+    graph.rule(cc).input(src.data).output(obj.data).depfile = dep.data;
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 1);
+
+    unlink(obj.data);
+    unlink(dep.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 1);
+    CHECK(cache.hits == 1);
+    CHECK(file_exists(obj.data));
+    CHECK(file_exists(dep.data));
+
+    write_file(hdr.data, "#define VALUE 2\n");
+    unlink(obj.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 2);
+    CHECK(cache.hits == 1);
+
+    write_file(hdr.data, "#define VALUE 1\n");
+    unlink(obj.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 2);
+    CHECK(cache.hits == 2);
+
+    graph.release();
+    pool.release();
+    cache.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_CASE("Identical actions run once")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_dedup_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder cache_dir, src, out1, out2, runs, script;
+    cache_dir.push(dir).push("/cache").push('\0');
+    src.push(dir).push("/src").push('\0');
+    out1.push(dir).push("/out1").push('\0');
+    out2.push(dir).push("/out2").push('\0');
+    runs.push(dir).push("/runs").push('\0');
+    script.push("echo run >> ").push(runs.data).push("; sleep 0.1; cp ").push(src.data).push(' ').push(out1.data)
+          .push("; cp ").push(src.data).push(' ').push(out2.data).push('\0');
+    write_file(src.data, "v1");
+
+    Action_Cache cache;
+    REQUIRE(cache.open(cache_dir.data));
+    Command cp;
+    cp.push((char*)"sh").push((char*)"-c").push(script.data).push_null();
+    Job_Pool pool(2);
+    Graph graph;
+    graph.cache = &cache;
+    graph.rule(cp).input(src.data).output(out1.data);
+    graph.rule(cp).input(src.data).output(out2.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 1);
+    CHECK(cache.hits == 1);
+    CHECK(file_exists(out1.data));
+    CHECK(file_exists(out2.data));
+
+    List<char> content;
+    REQUIRE(read_entire_file(runs.data, content));
+    CHECK(content.length == 4);
+    content.release();
+
+    graph.release();
+    pool.release();
+    cache.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+struct Held_Lock
+{
+    Action_Cache *cache;
+    uint64_t key;
+    int fd;
+    const char *entry_path;
+    List<char> entry;
+};
+
+static void *finish_held(void *arg)
+{
+    Held_Lock &held = *(Held_Lock *)arg;
+    usleep(200 * 1000);
+    write_entire_file(held.entry_path, held.entry.items, held.entry.length);
+    held.cache->unlock(held.key, held.fd);
+    return nullptr;
+}
+
+TEST_CASE("Waits on another process running the action")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_dedup_lock_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder cache_dir, src, out, script;
+    cache_dir.push(dir).push("/cache").push('\0');
+    src.push(dir).push("/src").push('\0');
+    out.push(dir).push("/out").push('\0');
+    script.push("cp ").push(src.data).push(' ').push(out.data).push('\0');
+    write_file(src.data, "v1");
+
+    Action_Cache cache;
+    REQUIRE(cache.open(cache_dir.data));
+    Command cp;
+    cp.push((char*)"sh").push((char*)"-c").push(script.data).push_null();
+    Job_Pool pool(1);
+    Graph graph;
+    graph.cache = &cache;
+    graph.rule(cp).input(src.data).output(out.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 1);
+
+    // Pretend another process is running it: the entry is not there yet and
+    // shows up just before the lock is let go.
+    char entry_path[PATH_MAX];
+    uint64_t key = graph.rules.items[0].key;
+    snprintf(entry_path, sizeof(entry_path), "%s/ac/%016llx", cache_dir.data, (unsigned long long)key);
+    Action_Cache other;
+    REQUIRE(other.open(cache_dir.data));
+    Held_Lock held = { &other, key, other.lock(key, false), entry_path, {} };
+    REQUIRE(held.fd >= 0);
+    REQUIRE(read_entire_file(entry_path, held.entry));
+    unlink(entry_path);
+    unlink(out.data);
+
+    pthread_t thread;
+    REQUIRE(pthread_create(&thread, nullptr, finish_held, &held) == 0);
+    REQUIRE(graph.build(pool));
+    pthread_join(thread, nullptr);
+    CHECK(pool.results.length == 1);
+    CHECK(cache.hits == 1);
+    CHECK(file_exists(out.data));
+
+    held.entry.release();
+    graph.release();
+    pool.release();
+    other.close();
+    cache.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+static size_t thread_count()
+{
+    size_t count = 0;
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir) return 0;
+    while (dirent *entry = readdir(dir))
+        if (entry->d_name[0] != '.') count++;
+    closedir(dir);
+    return count;
+}
+
+TEST_CASE("Lock waits share one thread")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_dedup_waits_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    Action_Cache cache, other;
+    REQUIRE(cache.open(dir));
+    REQUIRE(other.open(dir));
+    int held[100];
+    for (size_t idx = 0; idx < 100; ++idx)
+    {
+        held[idx] = other.lock(idx + 1, false);
+        REQUIRE(held[idx] >= 0);
+    }
+
+    Remote_Queue queue;
+    size_t before = thread_count();
+    REQUIRE(queue.start(&cache));
+    for (size_t idx = 0; idx < 100; ++idx) queue.wait_lock(idx, idx + 1);
+    CHECK(thread_count() <= before + 2);
+
+    for (size_t idx = 0; idx < 100; ++idx) other.unlock(idx + 1, held[idx]);
+    size_t got = 0;
+    while (got < 100)
+    {
+        queue.wait();
+        Remote_Job job;
+        while (queue.pop(job))
+        {
+            CHECK(job.kind == REMOTE_LOCK);
+            CHECK(job.key == job.rule + 1);
+            REQUIRE(job.fd >= 0);
+            cache.unlock(job.key, job.fd);
+            got++;
+        }
+    }
+    queue.stop();
+
+    other.close();
+    cache.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Failed build does not wait on another process")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_dedup_fail_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder cache_dir, src, out, bad, script;
+    cache_dir.push(dir).push("/cache").push('\0');
+    src.push(dir).push("/src").push('\0');
+    out.push(dir).push("/out").push('\0');
+    bad.push(dir).push("/bad").push('\0');
+    script.push("cp ").push(src.data).push(' ').push(out.data).push('\0');
+    write_file(src.data, "v1");
+
+    Action_Cache cache;
+    REQUIRE(cache.open(cache_dir.data));
+    Command cp;
+    cp.push((char*)"sh").push((char*)"-c").push(script.data).push_null();
+    Command fail;
+    fail.push((char*)"sh").push((char*)"-c").push((char*)"sleep 0.2; exit 1").push_null();
+    Job_Pool pool(2);
+
+    Graph probe;
+    probe.cache = &cache;
+    probe.rule(cp).input(src.data).output(out.data);
+    REQUIRE(probe.build(pool));
+    uint64_t key = probe.rules.items[0].key;
+    probe.release();
+    char entry_path[PATH_MAX];
+    snprintf(entry_path, sizeof(entry_path), "%s/ac/%016llx", cache_dir.data, (unsigned long long)key);
+    unlink(entry_path);
+    unlink(out.data);
+
+    // Held for the whole build, like a process that hung mid-action.
+    Action_Cache other;
+    REQUIRE(other.open(cache_dir.data));
+    int held = other.lock(key, false);
+    REQUIRE(held >= 0);
+
+    Graph graph;
+    graph.cache = &cache;
+    graph.rule(cp).input(src.data).output(out.data);
+    graph.rule(fail).input(src.data).output(bad.data);
+    uint64_t start = now_ns();
+    CHECK_FALSE(graph.build(pool));
+    CHECK(now_ns() - start < 2000000000ull);
+    CHECK(graph.rules.items[0].state == RULE_BLOCKED);
+    CHECK(graph.rules.items[1].state == RULE_FAILED);
+
+    other.unlock(key, held);
+    graph.release();
+    pool.release();
+    other.close();
+    cache.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Remote cache");
+static void *run_server(void *arg)
+{
+    ((Cache_Server *)arg)->run();
+    return nullptr;
+}
+
+TEST_CASE("HTTP round trip")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_remote_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    Cache_Server server;
+    REQUIRE(server.listen(dir));
+    pthread_t thread;
+    REQUIRE(pthread_create(&thread, nullptr, run_server, &server) == 0);
+
+    char url[64];
+    std::snprintf(url, sizeof(url), "http://127.0.0.1:%d/", server.port);
+    Remote_Cache remote;
+    REQUIRE(remote.open(url));
+
+    const size_t count = 40;
+    uint64_t names[count + 1];
+    List<char> bodies[count + 1];
+    bool found[count + 1];
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        names[idx] = idx + 1;
+        for (size_t byte = 0; byte < idx * 1000; ++byte) bodies[idx].push((char)(byte + idx));
+    }
+    names[count] = 0xdead;
+    CHECK(remote.put_many("cas", names, bodies, count));
+
+    List<char> got[count + 1];
+    CHECK(remote.get_many("cas", names, count + 1, got, found));
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        CHECK(found[idx]);
+        REQUIRE(got[idx].length == bodies[idx].length);
+        CHECK(std::memcmp(got[idx].items, bodies[idx].items, got[idx].length) == 0);
+    }
+    CHECK_FALSE(found[count]);
+
+    SUBCASE("reconnects after the server dropped the connection")
+    {
+        shutdown(remote.fd, SHUT_RDWR);
+        CHECK(remote.get_many("cas", names + 1, 1, got, found));
+        CHECK(found[0]);
+    }
+
+    for (size_t idx = 0; idx <= count; ++idx)
+    {
+        bodies[idx].release();
+        got[idx].release();
+    }
+    remote.close();
+    server.stop();
+    pthread_join(thread, nullptr);
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Unresponsive server times out")
+{
+    tmp_buffer.save();
+
+    // A listener that never accepts: once its backlog is full, further
+    // SYNs are dropped and a connect only ever ends by timing out.
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    REQUIRE(listener >= 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(bind(listener, (sockaddr *)&addr, sizeof(addr)) == 0);
+    REQUIRE(listen(listener, 0) == 0);
+    socklen_t len = sizeof(addr);
+    REQUIRE(getsockname(listener, (sockaddr *)&addr, &len) == 0);
+
+    int fillers[4];
+    for (size_t idx = 0; idx < 4; ++idx)
+    {
+        fillers[idx] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        connect(fillers[idx], (sockaddr *)&addr, sizeof(addr));
+    }
+
+    char url[64];
+    std::snprintf(url, sizeof(url), "http://127.0.0.1:%d/", ntohs(addr.sin_port));
+    Remote_Cache remote;
+    REQUIRE(remote.open(url));
+    remote.timeout = 0.3;
+
+    uint64_t name = 1;
+    List<char> body;
+    bool found = true;
+    uint64_t start = now_ns();
+    CHECK_FALSE(remote.get_many("cas", &name, 1, &body, &found));
+    CHECK_FALSE(found);
+    CHECK(now_ns() - start < 3000000000ull);
+
+    body.release();
+    remote.close();
+    for (size_t idx = 0; idx < 4; ++idx) close(fillers[idx]);
+    close(listener);
+    tmp_buffer.load();
+}
+
+TEST_CASE("Graph shares results through the remote")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_remote_graph_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder server_dir, local_a, local_b, src, hdr, obj, dep, out, script;
+    server_dir.push(dir).push("/server").push('\0');
+    local_a.push(dir).push("/a").push('\0');
+    local_b.push(dir).push("/b").push('\0');
+    src.push(dir).push("/a.c").push('\0');
+    hdr.push(dir).push("/a.h").push('\0');
+    obj.push(dir).push("/a.o").push('\0');
+    dep.push(dir).push("/a.d").push('\0');
+    out.push(dir).push("/out").push('\0');
+    script.push("echo generated; cp ").push(obj.data).push(' ').push(out.data).push('\0');
+    write_file(hdr.data, "#define VALUE 1\n");
+    write_file(src.data, "#include \"a.h\"\nint value = VALUE;\n");
+
+    Cache_Server server;
+    REQUIRE(server.listen(server_dir.data));
+    pthread_t thread;
+    REQUIRE(pthread_create(&thread, nullptr, run_server, &server) == 0);
+    char url[64];
+    std::snprintf(url, sizeof(url), "http://127.0.0.1:%d", server.port);
+
+    Command cc, copy;
+    cc.push((char*)"cc").push((char*)"-c").push(src.data).push((char*)"-o").push(obj.data)
+      .push((char*)"-MMD").push((char*)"-MF").push(dep.data).push_null();
+    copy.push((char*)"sh").push((char*)"-c").push(script.data).push_null();
+
+    Remote_Cache remote;
+    REQUIRE(remote.open(url));
+    Action_Cache cache;
+    REQUIRE(cache.open(local_a.data));
+    cache.remote = &remote;
+    Job_Pool pool(2);
+    pool.capture_output = true;
+    pool.echo_output = false;
+    Graph graph;
+    graph.cache = &cache;
+    graph.rule(cc).input(src.data).output(obj.data).depfile = dep.data;
+    graph.rule(copy).input(obj.data).output(out.data);
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 2);
+    cache.close();
+
+    unlink(obj.data);
+    unlink(dep.data);
+    unlink(out.data);
+    REQUIRE(cache.open(local_b.data));
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 2);
+    CHECK(cache.hits == 2);
+    CHECK(file_exists(obj.data));
+    CHECK(file_exists(dep.data));
+    CHECK(file_exists(out.data));
+
+    SUBCASE("changed header is built locally")
+    {
+        write_file(hdr.data, "#define VALUE 2\n");
+        unlink(obj.data);
+        cache.close();
+        Command rm_local;
+        rm_local.push((char*)"rm").push((char*)"-rf").push(local_b.data).push_null();
+        start_process(rm_local).wait();
+        REQUIRE(cache.open(local_b.data));
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 4);
+    }
+
+    graph.release();
+    pool.release();
+    cache.close();
+    remote.close();
+    server.stop();
+    pthread_join(thread, nullptr);
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Racing local runs against fetches")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_race_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder server_dir, local_a, local_b, db_path, src, out, slow, stamp, script;
+    server_dir.push(dir).push("/server").push('\0');
+    local_a.push(dir).push("/a").push('\0');
+    local_b.push(dir).push("/b").push('\0');
+    db_path.push(dir).push("/db").push('\0');
+    src.push(dir).push("/src").push('\0');
+    out.push(dir).push("/out").push('\0');
+    slow.push(dir).push("/slow").push('\0');
+    stamp.push(dir).push("/stamp").push('\0');
+    script.push("if [ -e ").push(slow.data).push(" ]; then sleep 5; fi; cp ")
+          .push(src.data).push(' ').push(out.data).push("; date +%s > ").push(stamp.data).push('\0');
+    write_file(src.data, "payload");
+
+    Cache_Server server;
+    REQUIRE(server.listen(server_dir.data));
+    pthread_t thread;
+    REQUIRE(pthread_create(&thread, nullptr, run_server, &server) == 0);
+    char url[64];
+    std::snprintf(url, sizeof(url), "http://127.0.0.1:%d", server.port);
+
+    Command cp;
+    cp.push((char*)"sh").push((char*)"-c").push(script.data).push_null();
+    Remote_Cache remote;
+    Action_Cache cache;
+    Build_DB db;
+    REQUIRE(db.open(db_path.data));
+    Job_Pool pool(2);
+    Graph graph;
+    graph.db = &db;
+    graph.cache = &cache;
+    graph.race_below = 10;
+    graph.rule(cp).input(src.data).output(out.data);
+
+    SUBCASE("fetch wins")
+    {
+        REQUIRE(remote.open(url));
+        REQUIRE(cache.open(local_a.data));
+        cache.remote = &remote;
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 1);
+        cache.close();
+
+        write_file(slow.data, "");
+        unlink(out.data);
+        REQUIRE(cache.open(local_b.data));
+        cache.remote = &remote;
+        uint64_t start = now_ns();
+        REQUIRE(graph.build(pool));
+        CHECK(now_ns() - start < 4000000000ull);
+        REQUIRE(pool.results.length == 2);
+        CHECK(pool.results.items[1].proc.cancelled);
+        CHECK(cache.hits == 1);
+        CHECK(file_exists(out.data));
+    }
+
+    SUBCASE("local run wins")
+    {
+        int sink = socket(AF_INET, SOCK_STREAM, 0);
+        REQUIRE(sink >= 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        REQUIRE(bind(sink, (sockaddr *)&addr, sizeof(addr)) == 0);
+        REQUIRE(listen(sink, 4) == 0);
+        REQUIRE(getsockname(sink, (sockaddr *)&addr, &len) == 0);
+        std::snprintf(url, sizeof(url), "http://127.0.0.1:%d", ntohs(addr.sin_port));
+
+        REQUIRE(cache.open(local_a.data));
+        REQUIRE(graph.build(pool));
+        CHECK(pool.results.length == 1);
+
+        REQUIRE(remote.open(url));
+        remote.timeout = 3;
+        cache.remote = &remote;
+        write_file(src.data, "changed");
+        time_t start = time(nullptr);
+        REQUIRE(graph.build(pool));
+        REQUIRE(pool.results.length == 2);
+        CHECK(pool.results.items[1].ok());
+        CHECK(cache.hits == 0);
+        List<char> ran_at;
+        REQUIRE(read_entire_file(stamp.data, ran_at));
+        ran_at.push('\0');
+        CHECK(std::atol(ran_at.items) - start <= 1);
+        ran_at.release();
+        close(sink);
+    }
+
+    graph.release();
+    pool.release();
+    db.close();
+    cache.close();
+    remote.close();
+    server.stop();
+    pthread_join(thread, nullptr);
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Graph");
+static Command log_step(const char *log, const char *name)
+{
+    String_Builder script;
+    script.push("echo ").push(name).push(" >> ").push(log).push('\0');
+    Command cmd;
+    cmd.push((char*)"sh").push((char*)"-c").push(script.data).push_null();
+    return cmd;
+}
+
+TEST_CASE("Topological execution")
+{
+    tmp_buffer.save();
+    char log[] = "/tmp/maker_graph_XXXXXX";
+    int fd = mkstemp(log);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    Job_Pool pool(4);
+    Graph graph;
+
+    graph.rule(log_step(log, "gen")).output("gen.h");
+    graph.rule(log_step(log, "a")).input("a.c").input("gen.h").output("a.o");
+    graph.rule(log_step(log, "b")).input("b.c").input("gen.h").output("b.o");
+    graph.rule(log_step(log, "link")).input("a.o").input("b.o").output("app");
+    graph.rule(log_step(log, "other")).output("other");
+
+    List<char> out;
+
+    SUBCASE("everything, in dependency order")
+    {
+        CHECK(graph.build(pool));
+        REQUIRE(read_entire_file(log, out));
+        String_View lines;
+        lines.data = out.items;
+        lines.len = out.length;
+
+        List<String_View> order;
+        while (lines.len > 0) order.push(lines.chop('\n'));
+        REQUIRE(order.length == 5);
+
+        size_t gen = 5, link = 5, a = 5;
+        for (size_t idx = 0; idx < order.length; ++idx)
+        {
+            if (order.items[idx] == "gen") gen = idx;
+            if (order.items[idx] == "link") link = idx;
+            if (order.items[idx] == "a") a = idx;
+        }
+        CHECK(gen < a);
+        CHECK(a < link);
+        order.release();
+    }
+
+    SUBCASE("only what a target needs")
+    {
+        CHECK(graph.build(pool, "a.o"));
+        REQUIRE(read_entire_file(log, out));
+        CHECK(out.length == std::strlen("gen\na\n"));
+    }
+
+    SUBCASE("a failure stops dependents")
+    {
+        Command fail;
+        fail.push((char*)"false").push_null();
+        graph.rules.items[1].cmd = fail;
+        CHECK_FALSE(graph.build(pool, "app"));
+        CHECK(graph.rules.items[3].state == RULE_WAITING);
+    }
+
+    SUBCASE("cycles fail")
+    {
+        graph.rules.items[0].input("app");
+        CHECK_FALSE(graph.build(pool));
+        CHECK(pool.results.length == 1);
+    }
+
+    out.release();
+    graph.release();
+    pool.release();
+    unlink(log);
+    tmp_buffer.load();
+}
+
+TEST_CASE("Incremental build")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_incremental_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder src, mid, dst;
+    src.push(dir).push("/src").push('\0');
+    mid.push(dir).push("/mid").push('\0');
+    dst.push(dir).push("/dst").push('\0');
+    write_file(src.data, "hello\n");
+    set_mtime(src.data, 1000);
+
+    Command cp1;
+    cp1.push((char*)"cp").push(src.data).push(mid.data).push_null();
+    Command cp2;
+    cp2.push((char*)"cp").push(mid.data).push(dst.data).push_null();
+
+    Job_Pool pool(2);
+    Graph graph;
+    graph.rule(cp1).input(src.data).output(mid.data);
+    graph.rule(cp2).input(mid.data).output(dst.data);
+
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 2);
+
+    SUBCASE("nothing to do")
+    {
+        CHECK(graph.build(pool));
+        CHECK(pool.results.length == 2);
+        CHECK_FALSE(graph.rules.items[0].ran);
+    }
+
+    SUBCASE("touched source rebuilds the chain")
+    {
+        set_mtime(src.data, time(nullptr) + 10);
+        CHECK(graph.build(pool));
+        CHECK(pool.results.length == 4);
+    }
+
+    graph.release();
+    pool.release();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Header dependencies")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_headers_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder src, hdr, obj, dep, log_path;
+    src.push(dir).push("/a.c").push('\0');
+    hdr.push(dir).push("/a.h").push('\0');
+    obj.push(dir).push("/a.o").push('\0');
+    dep.push(dir).push("/a.d").push('\0');
+    log_path.push(dir).push("/deps").push('\0');
+    write_file(hdr.data, "#define VALUE 1\n");
+    write_file(src.data, "#include \"a.h\"\nint value = VALUE;\n");
+    set_mtime(hdr.data, 1000);
+    set_mtime(src.data, 1000);
+
+    Command cc;
+    cc.push((char*)"cc").push((char*)"-c").push(src.data).push((char*)"-o").push(obj.data)
+      .push((char*)"-MMD").push((char*)"-MF").push(dep.data).push_null();
+
+    Deps_Log deps;
+    REQUIRE(deps.open(log_path.data));
+    Job_Pool pool(1);
+    Graph graph;
+    graph.deps = &deps;
+    graph.rule(cc).input(src.data).output(obj.data).depfile = dep.data;
+
+    REQUIRE(graph.build(pool));
+    CHECK(pool.results.length == 1);
+    CHECK_FALSE(file_exists(dep.data));
+    REQUIRE(deps.lookup(obj.data) != nullptr);
+
+    SUBCASE("no-op")
+    {
+        CHECK(graph.build(pool));
+        CHECK(pool.results.length == 1);
+    }
+
+    SUBCASE("touched header")
+    {
+        set_mtime(hdr.data, time(nullptr) + 10);
+        CHECK(graph.build(pool));
+        CHECK(pool.results.length == 2);
+    }
+
+    graph.release();
+    pool.release();
+    deps.close();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Unity_Build");
+TEST_CASE("Chunking")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_unity_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    const char *names[] = { "big.cc", "a.cc", "b.cc", "c.cc", "d.cc" };
+    String_View sources[5];
+    for (size_t idx = 0; idx < 5; ++idx)
+    {
+        String_Builder path;
+        path.push(dir).push('/').push(names[idx]).push('\0');
+        FILE *f = std::fopen(path.data, "w");
+        REQUIRE(f != nullptr);
+        std::fprintf(f, "static int %c%zu() { return %zu; }\n", names[idx][0], idx, idx);
+        std::fclose(f);
+        sources[idx] = path.data;
+    }
+    double costs[5] = { 4, 1, 1, 1, 1 };
+
+    String_Builder prefix;
+    prefix.push(dir).push("/unity").push('\0');
+
+    Unity_Build unity;
+    unity.prefix = prefix.data;
+    unity.chunk_count = 2;
+
+    REQUIRE(unity.generate(sources, costs, 4) == 2);
+    CHECK(unity.chunks.items[0].sources.length == 1);
+    CHECK(unity.chunks.items[1].sources.length == 3);
+
+    SUBCASE("unchanged sources keep their files")
+    {
+        CHECK(unity.generate(sources, costs, 4) == 0);
+    }
+
+    SUBCASE("a new source only touches one chunk")
+    {
+        CHECK(unity.generate(sources, costs, 5) == 1);
+        CHECK_FALSE(unity.chunks.items[0].changed);
+        CHECK(unity.chunks.items[1].changed);
+        CHECK(unity.chunks.items[1].sources.length == 4);
+    }
+
+    SUBCASE("drifting costs rebalance")
+    {
+        double skewed[5] = { 1, 1, 1, 9, 1 };
+        CHECK(unity.generate(sources, skewed, 4) == 2);
+        CHECK(unity.chunks.items[0].cost == 9);
+    }
+
+    SUBCASE("chunks compile, only when stale")
+    {
+        Job_Pool pool(2);
+        Command cc;
+        cc.push((char*)"c++").push((char*)"-w").push_null();
+        CHECK(unity.submit(pool, cc) == 2);
+        CHECK(pool.wait_all());
+
+        CHECK(unity.generate(sources, costs, 4) == 0);
+        CHECK(unity.submit(pool, cc) == 0);
+
+        time_t past = time(nullptr) - 100;
+        for (size_t idx = 0; idx < 5; ++idx) set_mtime(sources[idx].data, past);
+        const char *exts[] = { ".cc", ".o", ".d" };
+        for (size_t c = 0; c < 2; ++c)
+            for (size_t ext = 0; ext < 3; ++ext)
+            {
+                char path[PATH_MAX];
+                std::snprintf(path, sizeof(path), "%s_%zu%s", prefix.data, c, exts[ext]);
+                set_mtime(path, past);
+            }
+        CHECK(unity.submit(pool, cc) == 0);
+        set_mtime(sources[2].data, past + 50);
+        CHECK(unity.submit(pool, cc) == 1);
+        CHECK(pool.wait_all());
+        CHECK(unity.submit(pool, cc) == 0);
+        pool.release();
+    }
+
+    unity.release();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_CASE("Many chunks")
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_unity_many_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    List<char> names;
+    String_View sources[64];
+    for (size_t idx = 0; idx < 64; ++idx)
+    {
+        char path[PATH_MAX];
+        std::snprintf(path, sizeof(path), "%s/source_number_%zu.cc", dir, idx);
+        write_file(path, "");
+        names.append(path, std::strlen(path) + 1);
+    }
+    for (size_t idx = 0, at = 0; idx < 64; ++idx)
+    {
+        sources[idx] = names.items + at;
+        at += sources[idx].len + 1;
+    }
+
+    char prefix[PATH_MAX];
+    std::snprintf(prefix, sizeof(prefix), "%s/unity", dir);
+    Unity_Build unity;
+    unity.prefix = prefix;
+    unity.chunk_count = 64;
+    REQUIRE(unity.generate(sources, nullptr, 64) == 64);
+
+    Job_Pool pool(4);
+    Command cc;
+    cc.push((char*)"true").push((char*)"-O2").push((char*)"-g").push((char*)"-Wall").push((char*)"-Wextra")
+      .push((char*)"-std=c++17").push((char*)"-fPIC").push((char*)"-DNDEBUG").push((char*)"-Iinclude")
+      .push((char*)"-pthread").push_null();
+    size_t used = tmp_buffer.idx;
+    CHECK(unity.submit(pool, cc) == 64);
+    CHECK(pool.wait_all());
+    CHECK(tmp_buffer.idx == used);
+
+    pool.release();
+    unity.release();
+    names.release();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Pipeline");
+TEST_CASE("Run pipeline")
+{
+    tmp_buffer.save();
+
+    Command gen;
+    gen.push((char*)"printf").push((char*)"b\\na\\nc\\n").push_null();
+    Command sort;
+    sort.push((char*)"sort").push_null();
+    Command head;
+    head.push((char*)"head").push((char*)"-n").push((char*)"1").push_null();
+
+    SUBCASE("stages are connected")
+    {
+        Pipeline pipeline;
+        pipeline.push(gen).push(sort).push(head);
+        Pipeline_Result res = pipeline.run(true);
+
+        REQUIRE(res.stages.length == 3);
+        CHECK(res.ok());
+        const List<char> &out = res.stages.items[2].out;
+        REQUIRE(out.length == 2);
+        CHECK(std::strncmp(out.items, "a\n", 2) == 0);
+        res.release();
+    }
+
+    SUBCASE("failing stage fails the pipeline")
+    {
+        Command fail;
+        fail.push((char*)"false").push_null();
+
+        Pipeline pipeline;
+        pipeline.push(gen).push(fail).push(sort);
+        Pipeline_Result res = pipeline.run();
+
+        REQUIRE(res.stages.length == 3);
+        CHECK_FALSE(res.ok());
+        CHECK(res.stages.items[2].ok());
+        CHECK(res.stages.items[1].exit_code == 1);
+        res.release();
+    }
+
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("PATH cache");
+TEST_CASE("Resolve program")
+{
+    SUBCASE("found on PATH")
+    {
+        const char *sh = resolve_program("sh");
+        REQUIRE(sh != nullptr);
+        CHECK(sh[0] == '/');
+        CHECK(resolve_program("sh") == sh);
+    }
+
+    SUBCASE("paths are used as is")
+    {
+        const char *path = "./no/such/program";
+        CHECK(resolve_program(path) == path);
+    }
+
+    SUBCASE("missing program")
+    {
+        CHECK(resolve_program("maker-no-such-program") == nullptr);
+    }
+
+    SUBCASE("PATH change invalidates")
+    {
+        const char *before = resolve_program("sh");
+        REQUIRE(before != nullptr);
+        char *old_path = temp::strdup(getenv("PATH"));
+        setenv("PATH", "/nonexistent", 1);
+        CHECK(resolve_program("sh") == nullptr);
+        setenv("PATH", old_path, 1);
+        CHECK(resolve_program("sh") != nullptr);
+    }
+
+    invalidate_path_cache();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Job_Pool");
+TEST_CASE("Bounded parallelism")
+{
+    tmp_buffer.save();
+    Job_Pool pool(2);
+
+    Command ok;
+    ok.push((char*)"true").push_null();
+    Command fail;
+    fail.push((char*)"false").push_null();
+
+    SUBCASE("slots are capped and refilled")
+    {
+        for (size_t idx = 0; idx < 5; ++idx)
+        {
+            CHECK(pool.submit(ok) == idx);
+            CHECK(pool.running.length <= 2);
+        }
+        CHECK(pool.wait_all());
+        CHECK(pool.results.length == 5);
+        CHECK(pool.running.length == 0);
+    }
+
+    SUBCASE("failures are reported per job")
+    {
+        pool.submit(ok);
+        size_t bad = pool.submit(fail);
+        CHECK_FALSE(pool.wait_all());
+
+        for (size_t idx = 0; idx < pool.results.length; ++idx)
+            CHECK(pool.results.items[idx].ok() == (pool.results.items[idx].id != bad));
+    }
+
+    SUBCASE("captured output stays with its job")
+    {
+        pool.capture_output = true;
+        pool.echo_output = false;
+
+        Command first;
+        first.push((char*)"sh").push((char*)"-c").push((char*)"sleep 0.1; echo first").push_null();
+        Command second;
+        second.push((char*)"sh").push((char*)"-c").push((char*)"echo second").push_null();
+
+        size_t first_id = pool.submit(first);
+        pool.submit(second);
+        CHECK(pool.wait_all());
+
+        for (size_t idx = 0; idx < pool.results.length; ++idx)
+        {
+            const Proc_Result &res = pool.results.items[idx].proc;
+            const char *expected = pool.results.items[idx].id == first_id ? "first\n" : "second\n";
+            REQUIRE(res.out.length == std::strlen(expected));
+            CHECK(std::strncmp(res.out.items, expected, res.out.length) == 0);
+        }
+    }
+
+    pool.release();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Jobserver")
+{
+    tmp_buffer.save();
+    const char *old = getenv("MAKEFLAGS");
+    char *saved = old ? temp::strdup(old) : nullptr;
+
+    Command sleep;
+    sleep.push((char*)"sleep").push((char*)"0.05").push_null();
+
+    SUBCASE("client takes tokens from the parent")
+    {
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        REQUIRE(write(fds[1], "+", 1) == 1);
+        char flags[64];
+        std::snprintf(flags, sizeof(flags), "-j2 --jobserver-auth=%d,%d", fds[0], fds[1]);
+        setenv("MAKEFLAGS", flags, 1);
+
+        Job_Pool pool(8);
+        for (size_t idx = 0; idx < 4; ++idx)
+        {
+            pool.submit(sleep);
+            CHECK(pool.running.length <= 2);
+        }
+        CHECK(pool.wait_all());
+        CHECK(pool.jobserver.tokens.length == 0);
+        pool.release();
+
+        char token;
+        CHECK(read(fds[0], &token, 1) == 1);
+        CHECK(token == '+');
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    SUBCASE("a token freed elsewhere wakes the pool")
+    {
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        char flags[64];
+        std::snprintf(flags, sizeof(flags), "-j2 --jobserver-auth=%d,%d", fds[0], fds[1]);
+        setenv("MAKEFLAGS", flags, 1);
+
+        Command slow;
+        slow.push((char*)"sleep").push((char*)"1").push_null();
+        Job_Pool pool(4);
+        pool.submit(slow);
+
+        pthread_t thread;
+        REQUIRE(pthread_create(&thread, nullptr, [](void *arg) -> void * {
+            usleep(100 * 1000);
+            ignore_result(write(*(int *)arg, "+", 1));
+            return nullptr;
+        }, &fds[1]) == 0);
+        uint64_t start = now_ns();
+        pool.submit(sleep);
+        CHECK(now_ns() - start < 700000000ull);
+        CHECK(pool.running.length == 2);
+        pthread_join(thread, nullptr);
+        CHECK(pool.wait_all());
+        pool.release();
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    SUBCASE("server advertises a pipe to children")
+    {
+        unsetenv("MAKEFLAGS");
+        Job_Pool pool(3);
+        pool.capture_output = true;
+        pool.echo_output = false;
+
+        Command show;
+        show.push((char*)"sh").push((char*)"-c").push((char*)"echo $MAKEFLAGS").push_null();
+        pool.submit(show);
+        REQUIRE(pool.jobserver.pipe_fds[0] >= 0);
+        CHECK(getenv("MAKEFLAGS") == nullptr);
+        CHECK(pool.wait_all());
+
+        const List<char> &out = pool.results.items[0].proc.out;
+        String_View line;
+        line.data = out.items;
+        line.len = out.length;
+        char expected[64];
+        std::snprintf(expected, sizeof(expected), "-j3 --jobserver-auth=%d,%d",
+                      pool.jobserver.pipe_fds[0], pool.jobserver.pipe_fds[1]);
+        CHECK(line.trim() == String_View(expected));
+        pool.release();
+    }
+
+    SUBCASE("fifo on request")
+    {
+        setenv("MAKEFLAGS", "k", 1);
+        Job_Pool pool(3);
+        pool.jobserver_fifo = true;
+        pool.capture_output = true;
+        pool.echo_output = false;
+
+        Command show;
+        show.push((char*)"sh").push((char*)"-c").push((char*)"echo $MAKEFLAGS").push_null();
+        pool.submit(show);
+        REQUIRE(pool.jobserver.fifo_path != nullptr);
+        CHECK(pool.wait_all());
+
+        const List<char> &out = pool.results.items[0].proc.out;
+        String_View line;
+        line.data = out.items;
+        line.len = out.length;
+        String_Builder expected;
+        expected.push("k -j3 --jobserver-auth=fifo:").push(pool.jobserver.fifo_path);
+        CHECK(line.trim() == expected.to_sv());
+        pool.release();
+        CHECK(String_View(getenv("MAKEFLAGS")) == "k");
+    }
+
+    SUBCASE("child make joins the default pool")
+    {
+        unsetenv("MAKEFLAGS");
+        char dir[] = "/tmp/maker_jobserver_XXXXXX";
+        REQUIRE(mkdtemp(dir) != nullptr);
+        String_Builder makefile;
+        makefile.push(dir).push("/Makefile").push('\0');
+        write_file(makefile.data, "all: a b\na b:\n\t@sleep 0.05\n");
+
+        Job_Pool pool(4);
+        pool.capture_output = true;
+        pool.echo_output = false;
+        Command make;
+        make.push((char*)"make").push((char*)"-s").push((char*)"-C").push(dir).push_null();
+        pool.submit(make);
+        CHECK(pool.wait_all());
+        CHECK(pool.results.items[0].ok());
+        CHECK(pool.results.items[0].proc.err.length == 0);
+        pool.release();
+
+        Command rm;
+        rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+        start_process(rm).wait();
+    }
+
+    if (saved) setenv("MAKEFLAGS", saved, 1);
+    else unsetenv("MAKEFLAGS");
+    tmp_buffer.load();
+}
+
+TEST_CASE("Timeouts and cancellation")
+{
+    tmp_buffer.save();
+    Job_Pool pool(4);
+    pool.procs.kill_grace = 0.2;
+
+    Command hang;
+    hang.push((char*)"sleep").push((char*)"10").push_null();
+    Command stubborn;
+    stubborn.push((char*)"sh").push((char*)"-c").push((char*)"trap '' TERM; sleep 10").push_null();
+    Command fail;
+    fail.push((char*)"false").push_null();
+
+    uint64_t start = now_ns();
+
+    SUBCASE("timeout sends SIGTERM")
+    {
+        pool.timeout = 0.1;
+        pool.submit(hang);
+        CHECK_FALSE(pool.wait_all());
+
+        const Proc_Result &res = pool.results.items[0].proc;
+        CHECK(res.timed_out);
+        CHECK(res.signal == SIGTERM);
+    }
+
+    SUBCASE("SIGKILL follows when SIGTERM is ignored")
+    {
+        pool.timeout = 0.1;
+        pool.submit(stubborn);
+        CHECK_FALSE(pool.wait_all());
+
+        const Proc_Result &res = pool.results.items[0].proc;
+        CHECK(res.timed_out);
+        CHECK(res.signal == SIGKILL);
+    }
+
+    SUBCASE("fail fast cancels siblings")
+    {
+        pool.fail_fast = true;
+        pool.submit(hang);
+        pool.submit(hang);
+        pool.submit(fail);
+        while (!pool.cancelled && pool.wait_one());
+        pool.submit(hang);
+        CHECK_FALSE(pool.wait_all());
+
+        REQUIRE(pool.results.length == 4);
+        size_t cancelled = 0;
+        for (size_t idx = 0; idx < pool.results.length; ++idx)
+            if (pool.results.items[idx].proc.cancelled) cancelled++;
+        CHECK(cancelled == 3);
+        CHECK(pool.running.length == 0);
+
+        Command ok;
+        ok.push((char*)"true").push_null();
+        pool.submit(ok);
+        CHECK(pool.wait_one());
+        CHECK(pool.results.items[4].ok());
+
+        pool.submit(fail);
+        while (!pool.cancelled && pool.wait_one());
+        Graph graph;
+        graph.rule(ok);
+        CHECK(graph.build(pool));
+        CHECK(pool.results.items[pool.results.length - 1].ok());
+        graph.release();
+    }
+
+    CHECK((now_ns() - start) / 1e9 < 5);
+
+    pool.release();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Batched submit"
+          * doctest::description("files are packed into as few invocations as allowed"))
+{
+    tmp_buffer.save();
+    Job_Pool pool(4);
+    pool.capture_output = true;
+    pool.echo_output = false;
+
+    String_View files[10] = {
+        "a.c", "b.c", "c.c", "d.c", "e.c", "f.c", "g.c", "h.c", "i.c", "j.c",
+    };
+
+    Command count;
+    count.push((char*)"sh").push((char*)"-c").push((char*)"echo $#").push((char*)"sh").push_null();
+
+    SUBCASE("capped per batch")
+    {
+        CHECK(submit_batched(pool, count, files, 10, 4) == 3);
+    }
+
+    SUBCASE("capped by argument size")
+    {
+        size_t base = 0;
+        for (char **env = environ; *env; ++env) base += std::strlen(*env) + 1 + sizeof(char*);
+        base += sizeof(char*) + 3 + 3 + 8 + 3 + 4 * sizeof(char*);
+        count.arg_limit = base + 5 * (4 + sizeof(char*));
+        CHECK(submit_batched(pool, count, files, 10) == 2);
+    }
+
+    SUBCASE("everything fits")
+    {
+        CHECK(submit_batched(pool, count, files, 10) == 1);
+    }
+
+    CHECK(pool.wait_all());
+    size_t total = 0;
+    for (size_t idx = 0; idx < pool.results.length; ++idx)
+        total += (size_t)std::atoi(pool.results.items[idx].proc.out.items);
+    CHECK(total == 10);
+
+    pool.release();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Batch compile"
+          * doctest::description("several sources per compiler invocation"))
+{
+    tmp_buffer.save();
+    char dir[] = "/tmp/maker_batch_XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+
+    String_Builder sb;
+    sb.push(dir).push("/sub").push('\0');
+    REQUIRE(mkdir(sb.data, 0755) == 0);
+
+    const char *names[] = { "a.c", "b.c", "sub/a.c", "c.c", "bad.c" };
+    String_View sources[5];
+    for (size_t idx = 0; idx < 5; ++idx)
+    {
+        String_Builder path;
+        path.push(dir).push('/').push(names[idx]).push('\0');
+        write_file(path.data, idx == 4 ? "int broken(" : "int f(void) { return 0; }\n");
+        sources[idx] = path.data;
+    }
+
+    String_Builder out;
+    out.push(dir).push("/out").push('\0');
+    REQUIRE(mkdir(out.data, 0755) == 0);
+
+    Job_Pool pool(2);
+    pool.capture_output = true;
+    pool.echo_output = false;
+
+    Command cc;
+    cc.push((char*)"cc").push_null();
+
+    SUBCASE("all good")
+    {
+        CHECK(compile_batched(pool, cc, sources, 4, out.data, 4));
+        CHECK(pool.results.length == 2);
+    }
+
+    SUBCASE("failing group falls back to single files")
+    {
+        CHECK_FALSE(compile_batched(pool, cc, sources, 5, out.data, 5));
+        CHECK(pool.results.length == 2 + 4);
+
+        size_t failed = 0;
+        for (size_t idx = 2; idx < pool.results.length; ++idx)
+            if (!pool.results.items[idx].ok()) failed++;
+        CHECK(failed == 1);
+    }
+
+    String_Builder obj;
+    obj.push(out.data).push("/b.o").push('\0');
+    CHECK(file_exists(obj.data));
+
+    pool.release();
+    Command rm;
+    rm.push((char*)"rm").push((char*)"-rf").push(dir).push_null();
+    start_process(rm).wait();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Batch compile many sources")
+{
+    tmp_buffer.save();
+
+    List<char> names;
+    List<size_t> offsets;
+    for (size_t idx = 0; idx < 600; ++idx)
+    {
+        char path[64];
+        int len = std::snprintf(path, sizeof(path), "/nonexistent/maker/source_%zu.c", idx);
+        offsets.push(names.length);
+        names.append(path, (size_t)len + 1);
+    }
+    List<String_View> sources;
+    for (size_t idx = 0; idx < 600; ++idx) sources.push(String_View(names.items + offsets.items[idx]));
+
+    Job_Pool pool(4);
+    Command cc;
+    cc.push((char*)"true").push_null();
+    size_t used = tmp_buffer.idx;
+    CHECK(compile_batched(pool, cc, sources.items, sources.length, "/tmp", 0));
+    CHECK(tmp_buffer.idx - used < 1024);
+
+    pool.release();
+    sources.release();
+    offsets.release();
+    names.release();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();
+
+TEST_SUITE_BEGIN("Proc_Set");
+TEST_CASE("Wait any"
+          * doctest::description("whichever child finishes first is returned first"))
+{
+    tmp_buffer.save();
+    Proc_Set set;
+
+    SUBCASE("pidfd") {}
+    SUBCASE("waitid fallback") { set.use_pidfd = false; }
+
+    Command slow;
+    slow.push((char*)"sleep").push((char*)"0.3").push_null();
+    Command fast;
+    fast.push((char*)"true").push_null();
+
+    set.add(start_process(slow));
+    Proc quick = start_process(fast);
+    set.add(quick);
+
+    Proc_Result done;
+    REQUIRE(set.wait_any(&done));
+    CHECK(done.pid == quick.pid);
+    CHECK(done.ok());
+    CHECK(set.procs.length == 1);
+
+    set.wait_all();
+    CHECK(set.procs.length == 0);
+    CHECK_FALSE(set.wait_any());
+
+    set.release();
+    tmp_buffer.load();
+}
+
+TEST_CASE("Captured output"
+          * doctest::description("pipes are drained while children run"))
+{
+    tmp_buffer.save();
+    Proc_Set set;
+
+    SUBCASE("pidfd") {}
+    SUBCASE("waitid fallback") { set.use_pidfd = false; }
+
+    Command cmd;
+    cmd.push((char*)"sh").push((char*)"-c").push((char*)"head -c 300000 /dev/zero; echo x >&2").push_null();
+    set.add(start_process(cmd, SPAWN_CAPTURE));
+
+    Proc_Result res;
+    REQUIRE(set.wait_any(&res));
+    CHECK(res.ok());
+    CHECK(res.out.length == 300000);
+    CHECK(res.err.length == 2);
+
+    res.release();
+    set.release();
+    tmp_buffer.load();
+}
+TEST_SUITE_END();